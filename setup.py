@@ -66,5 +66,6 @@ setup(
     long_description='',
     ext_modules=[CMakeExtension('cityflow')],
     cmdclass=dict(build_ext=CMakeBuild),
+    install_requires=['numpy'],
     zip_safe=False
 )
@@ -1,45 +1,313 @@
 #include "engine/engine.h"
 #include "engine/archive.h"
+#include "engine/vectorengine.h"
+
+#include <functional>
 
 #include "pybind11/pybind11.h"
+#include "pybind11/numpy.h"
 #include "pybind11/stl.h"
 
 namespace py = pybind11;
 using namespace py::literals;
 
+// Waits for the step started by next_step_async, without holding the GIL if it has it.
+static void waitForStep(CityFlow::Engine &engine) {
+    if (engine.pollStep() || !PyGILState_Check()) {
+        engine.waitStep();
+    } else {
+        py::gil_scoped_release release;
+        engine.waitStep();
+    }
+}
+
+// Engine methods wait for the step in flight, so a step is never raced by another call.
+template <typename Return, typename... Args>
+static std::function<Return(CityFlow::Engine &, Args...)> afterStep(Return (CityFlow::Engine::*method)(Args...)) {
+    return [method](CityFlow::Engine &engine, Args... args) -> Return {
+        waitForStep(engine);
+        return (engine.*method)(std::forward<Args>(args)...);
+    };
+}
+
+template <typename Return, typename... Args>
+static std::function<Return(CityFlow::Engine &, Args...)> afterStep(Return (CityFlow::Engine::*method)(Args...) const) {
+    return [method](CityFlow::Engine &engine, Args... args) -> Return {
+        waitForStep(engine);
+        return (engine.*method)(std::forward<Args>(args)...);
+    };
+}
+
+// what next_step_async returns, also an awaitable that polls the engine once per loop iteration
+class StepFuture {
+public:
+    explicit StepFuture(CityFlow::Engine &engine) : engine(engine) { }
+
+    bool done() const { return engine.pollStep(); }
+
+    void wait() { waitForStep(engine); }
+
+    void next() {
+        if (!done()) return;
+        wait();
+        throw py::stop_iteration();
+    }
+
+private:
+    CityFlow::Engine &engine;
+};
+
+// keeps engine storage alive for as long as arrays over it exist
+template <typename T>
+static py::capsule holderCapsule(std::shared_ptr<const T> data) {
+    typedef std::shared_ptr<const T> Holder;
+    return py::capsule(new Holder(std::move(data)), [](void *holder) { delete static_cast<Holder *>(holder); });
+}
+
+// read-only array over engine storage, the base keeps the storage alive
+template <typename T>
+static py::array_t<T> engineArray(const std::vector<T> &data, py::handle base) {
+    py::array_t<T> array({static_cast<py::ssize_t>(data.size())}, {static_cast<py::ssize_t>(sizeof(T))},
+                         data.data(), base);
+    array.attr("setflags")("write"_a=false);
+    return array;
+}
+
+static py::dict laneMetricsDict(const CityFlow::LaneMetrics &metrics, py::handle engine) {
+    py::dict ret;
+    ret["vehicle_count"] = engineArray(metrics.vehicleCount, engine);
+    ret["waiting_vehicle_count"] = engineArray(metrics.waitingVehicleCount, engine);
+    ret["mean_speed"] = engineArray(metrics.meanSpeed, engine);
+    ret["occupancy"] = engineArray(metrics.occupancy, engine);
+    return ret;
+}
+
+static py::dict roadMetricsDict(const CityFlow::RoadMetrics &metrics, py::handle engine) {
+    py::dict ret;
+    ret["vehicle_count"] = engineArray(metrics.vehicleCount, engine);
+    ret["waiting_vehicle_count"] = engineArray(metrics.waitingVehicleCount, engine);
+    ret["mean_speed"] = engineArray(metrics.meanSpeed, engine);
+    return ret;
+}
+
+static py::dict intersectionMetricsDict(const CityFlow::IntersectionMetrics &metrics, py::handle engine) {
+    py::dict ret;
+    ret["phase"] = engineArray(metrics.phase, engine);
+    ret["waiting_vehicle_count"] = engineArray(metrics.waitingVehicleCount, engine);
+    return ret;
+}
+
+static py::dict vehicleStateDict(std::shared_ptr<const CityFlow::VehicleStateColumns> state) {
+    const CityFlow::VehicleStateColumns &columns = *state;
+    py::capsule base = holderCapsule(std::move(state));
+    py::dict ret;
+    ret["handle"] = engineArray(columns.handle, base);
+    ret["speed"] = engineArray(columns.speed, base);
+    ret["distance"] = engineArray(columns.distance, base);
+    ret["drivable_index"] = engineArray(columns.drivableIndex, base);
+    ret["road_index"] = engineArray(columns.roadIndex, base);
+    ret["x"] = engineArray(columns.x, base);
+    ret["y"] = engineArray(columns.y, base);
+    ret["heading"] = engineArray(columns.heading, base);
+    ret["lane_change_direction"] = engineArray(columns.laneChangeDirection, base);
+    ret["enter_time"] = engineArray(columns.enterTime, base);
+    return ret;
+}
+
+// the subscribed variables of every subscribed domain
+static py::dict subscriptionResults(py::object self) {
+    using CityFlow::ObservationDomain;
+    CityFlow::Engine &engine = self.cast<CityFlow::Engine &>();
+    waitForStep(engine);
+    const CityFlow::ObservationRegistry &subscriptions = engine.getSubscriptions();
+    py::dict ret;
+    for (size_t i = 0; i < CityFlow::ObservationRegistry::DOMAIN_NUM; ++i) {
+        ObservationDomain domain = static_cast<ObservationDomain>(i);
+        if (!subscriptions.isSubscribed(domain)) continue;
+        py::dict all;
+        switch (domain) {
+            case ObservationDomain::LANE: {
+                auto metrics = engine.getLaneMetrics();
+                all = laneMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+            case ObservationDomain::ROAD: {
+                auto metrics = engine.getRoadMetrics();
+                all = roadMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+            case ObservationDomain::INTERSECTION: {
+                auto metrics = engine.getIntersectionMetrics();
+                all = intersectionMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+            case ObservationDomain::VEHICLE:
+                all = vehicleStateDict(engine.getVehicleState());
+                break;
+        }
+        py::dict subscribed;
+        for (const std::string &variable : subscriptions.getVariables(domain))
+            subscribed[variable.c_str()] = all[variable.c_str()];
+        ret[CityFlow::ObservationRegistry::getDomainName(domain)] = subscribed;
+    }
+    return ret;
+}
+
+// metrics of all environments, one row per environment
+static py::dict batchResults(py::object self) {
+    using CityFlow::ObservationDomain;
+    const CityFlow::VectorEngine &engine = self.cast<const CityFlow::VectorEngine &>();
+    const CityFlow::ObservationRegistry &subscriptions = engine.getSubscriptions();
+    py::dict ret;
+    for (ObservationDomain domain : {ObservationDomain::LANE, ObservationDomain::ROAD, ObservationDomain::INTERSECTION}) {
+        if (!subscriptions.isSubscribed(domain)) continue;
+        py::dict all;
+        switch (domain) {
+            case ObservationDomain::LANE: {
+                auto metrics = engine.getLaneMetrics();
+                all = laneMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+            case ObservationDomain::ROAD: {
+                auto metrics = engine.getRoadMetrics();
+                all = roadMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+            default: {
+                auto metrics = engine.getIntersectionMetrics();
+                all = intersectionMetricsDict(*metrics, holderCapsule(metrics));
+                break;
+            }
+        }
+        py::dict subscribed;
+        for (const std::string &variable : subscriptions.getVariables(domain))
+            subscribed[variable.c_str()] = all[variable.c_str()].attr("reshape")(engine.getEnvNum(), -1);
+        ret[CityFlow::ObservationRegistry::getDomainName(domain)] = subscribed;
+    }
+    return ret;
+}
+
+static py::array_t<bool> batchDones(const CityFlow::VectorEngine &engine) {
+    const std::vector<unsigned char> &dones = engine.getDones();
+    py::array_t<bool> ret(static_cast<py::ssize_t>(dones.size()));
+    bool *data = ret.mutable_data();
+    for (size_t i = 0; i < dones.size(); ++i) data[i] = dones[i] != 0;
+    return ret;
+}
+
 PYBIND11_MODULE(cityflow, m) {
     py::class_<CityFlow::Engine>(m, "Engine")
         .def(py::init<const std::string&, int>(),
             "config_file"_a,
             "thread_num"_a=1
         )
-        .def("next_step", &CityFlow::Engine::nextStep)
-        .def("get_vehicle_count", &CityFlow::Engine::getVehicleCount)
-        .def("get_vehicles", &CityFlow::Engine::getVehicles, "include_waiting"_a=false)
-        .def("get_lane_vehicle_count", &CityFlow::Engine::getLaneVehicleCount)
-        .def("get_lane_waiting_vehicle_count", &CityFlow::Engine::getLaneWaitingVehicleCount)
-        .def("get_lane_vehicles", &CityFlow::Engine::getLaneVehicles)
-        .def("get_vehicle_speed", &CityFlow::Engine::getVehicleSpeed)
-        .def("get_vehicle_info", &CityFlow::Engine::getVehicleInfo, "vehicle_id"_a)
-        .def("get_vehicle_distance", &CityFlow::Engine::getVehicleDistance)
-        .def("get_leader", &CityFlow::Engine::getLeader, "vehicle_id"_a)
-        .def("get_current_time", &CityFlow::Engine::getCurrentTime)
-        .def("get_average_travel_time", &CityFlow::Engine::getAverageTravelTime)
-        .def("set_tl_phase", &CityFlow::Engine::setTrafficLightPhase, "intersection_id"_a, "phase_id"_a)
-        .def("set_vehicle_speed", &CityFlow::Engine::setVehicleSpeed, "vehicle_id"_a, "speed"_a)
-        .def("set_replay_file", &CityFlow::Engine::setReplayLogFile, "replay_file"_a)
-        .def("set_random_seed", &CityFlow::Engine::setRandomSeed, "seed"_a)
-        .def("set_save_replay", &CityFlow::Engine::setSaveReplay, "open"_a)
-        .def("push_vehicle", (void (CityFlow::Engine::*)(const std::map<std::string, double>&, const std::vector<std::string>&)) &CityFlow::Engine::pushVehicle)
-        .def("reset", &CityFlow::Engine::reset, "seed"_a=false)
-        .def("load", &CityFlow::Engine::load, "archive"_a)
-        .def("snapshot", &CityFlow::Engine::snapshot)
-        .def("load_from_file", &CityFlow::Engine::loadFromFile, "path"_a)
-        .def("set_vehicle_route", &CityFlow::Engine::setRoute, "vehicle_id"_a, "route"_a);
+        .def("next_step", afterStep(&CityFlow::Engine::nextStep), py::call_guard<py::gil_scoped_release>())
+        .def("next_step_async", [](CityFlow::Engine &engine) {
+            waitForStep(engine);
+            engine.nextStepAsync();
+            return StepFuture(engine);
+        }, py::keep_alive<0, 1>())
+        .def("poll", &CityFlow::Engine::pollStep)
+        .def("wait_step", &waitForStep)
+        .def("next_steps", afterStep(&CityFlow::Engine::nextSteps), "steps"_a, "stop_when_empty"_a=false,
+             py::call_guard<py::gil_scoped_release>())
+        .def("run_until", afterStep(&CityFlow::Engine::runUntil), "time"_a, "stop_when_empty"_a=false,
+             py::call_guard<py::gil_scoped_release>())
+        .def("is_empty", afterStep(&CityFlow::Engine::isEmpty))
+        .def("get_vehicle_count", afterStep(&CityFlow::Engine::getVehicleCount))
+        .def("get_vehicles", afterStep(&CityFlow::Engine::getVehicles), "include_waiting"_a=false,
+             py::call_guard<py::gil_scoped_release>())
+        .def("get_lane_vehicle_count", afterStep(&CityFlow::Engine::getLaneVehicleCount), py::call_guard<py::gil_scoped_release>())
+        .def("get_lane_waiting_vehicle_count", afterStep(&CityFlow::Engine::getLaneWaitingVehicleCount),
+             py::call_guard<py::gil_scoped_release>())
+        .def("get_lane_vehicles", afterStep(&CityFlow::Engine::getLaneVehicles), py::call_guard<py::gil_scoped_release>())
+        .def("get_lane_ids", afterStep(&CityFlow::Engine::getLaneIds))
+        .def("get_road_ids", afterStep(&CityFlow::Engine::getRoadIds))
+        .def("get_intersection_ids", afterStep(&CityFlow::Engine::getIntersectionIds))
+        .def("get_lane_metrics", [](py::object self) {
+            CityFlow::Engine &engine = self.cast<CityFlow::Engine &>();
+            waitForStep(engine);
+            auto metrics = engine.getLaneMetrics();
+            return laneMetricsDict(*metrics, holderCapsule(metrics));
+        })
+        .def("subscribe", afterStep((void (CityFlow::Engine::*)(const std::string &, const std::vector<std::string> &))
+                                    &CityFlow::Engine::subscribe), "domain"_a, "variables"_a=std::vector<std::string>())
+        .def("unsubscribe", afterStep(&CityFlow::Engine::unsubscribe), "domain"_a)
+        .def("get_subscription_results", &subscriptionResults)
+        .def("get_vehicle_speed", afterStep(&CityFlow::Engine::getVehicleSpeed), py::call_guard<py::gil_scoped_release>())
+        .def("get_vehicle_info", afterStep(&CityFlow::Engine::getVehicleInfo), "vehicle_id"_a)
+        .def("get_vehicle_state", [](CityFlow::Engine &engine) {
+            waitForStep(engine);
+            return vehicleStateDict(engine.getVehicleState());
+        })
+        .def("get_vehicle_id", afterStep(&CityFlow::Engine::getVehicleId), "handle"_a)
+        .def("get_vehicle_distance", afterStep(&CityFlow::Engine::getVehicleDistance), py::call_guard<py::gil_scoped_release>())
+        .def("get_leader", afterStep(&CityFlow::Engine::getLeader), "vehicle_id"_a)
+        .def("get_current_time", afterStep(&CityFlow::Engine::getCurrentTime))
+        .def("get_average_travel_time", afterStep(&CityFlow::Engine::getAverageTravelTime),
+             py::call_guard<py::gil_scoped_release>())
+        .def("get_imbalance_factor", afterStep(&CityFlow::Engine::getImbalanceFactor))
+        .def("get_allocation_stats", afterStep(&CityFlow::Engine::getAllocationStats))
+        .def("get_kernel_variant", afterStep(&CityFlow::Engine::getKernelVariant))
+        .def("set_tl_phase", afterStep(&CityFlow::Engine::setTrafficLightPhase), "intersection_id"_a, "phase_id"_a)
+        .def("set_vehicle_speed", afterStep(&CityFlow::Engine::setVehicleSpeed), "vehicle_id"_a, "speed"_a)
+        .def("set_replay_file", afterStep(&CityFlow::Engine::setReplayLogFile), "replay_file"_a)
+        .def("set_random_seed", afterStep(&CityFlow::Engine::setRandomSeed), "seed"_a)
+        .def("set_save_replay", afterStep(&CityFlow::Engine::setSaveReplay), "open"_a)
+        .def("set_scalar_car_follow", afterStep(&CityFlow::Engine::setScalarCarFollow), "scalar"_a)
+        .def("push_vehicle", afterStep((void (CityFlow::Engine::*)(const std::map<std::string, double>&, const std::vector<std::string>&)) &CityFlow::Engine::pushVehicle))
+        .def("reset", afterStep(&CityFlow::Engine::reset), "seed"_a=false, py::call_guard<py::gil_scoped_release>())
+        .def("load", afterStep(&CityFlow::Engine::load), "archive"_a, py::call_guard<py::gil_scoped_release>())
+        .def("snapshot", afterStep(&CityFlow::Engine::snapshot), py::call_guard<py::gil_scoped_release>())
+        .def("load_from_file", afterStep(&CityFlow::Engine::loadFromFile), "path"_a, py::call_guard<py::gil_scoped_release>())
+        .def("set_vehicle_route", afterStep(&CityFlow::Engine::setRoute), "vehicle_id"_a, "route"_a);
+
+    py::class_<CityFlow::VectorEngine>(m, "VectorEngine")
+        .def(py::init<const std::string&, size_t, int, size_t>(),
+            "config_file"_a,
+            "env_num"_a,
+            "thread_num"_a=1,
+            "episode_steps"_a=0
+        )
+        .def("next_step", [](py::object self) {
+            CityFlow::VectorEngine &engine = self.cast<CityFlow::VectorEngine &>();
+            {
+                py::gil_scoped_release release;
+                engine.nextStep();
+            }
+            return py::make_tuple(batchResults(self), batchDones(engine));
+        })
+        .def("reset", [](py::object self) {
+            CityFlow::VectorEngine &engine = self.cast<CityFlow::VectorEngine &>();
+            {
+                py::gil_scoped_release release;
+                engine.reset();
+            }
+            return batchResults(self);
+        })
+        .def("get_env_num", &CityFlow::VectorEngine::getEnvNum)
+        .def("get_env", &CityFlow::VectorEngine::getEnv, "index"_a, py::return_value_policy::reference_internal)
+        .def("get_dones", &batchDones)
+        .def("get_lane_ids", &CityFlow::VectorEngine::getLaneIds)
+        .def("get_road_ids", &CityFlow::VectorEngine::getRoadIds)
+        .def("get_intersection_ids", &CityFlow::VectorEngine::getIntersectionIds)
+        .def("subscribe", &CityFlow::VectorEngine::subscribe, "domain"_a, "variables"_a=std::vector<std::string>())
+        .def("unsubscribe", &CityFlow::VectorEngine::unsubscribe, "domain"_a)
+        .def("get_subscription_results", &batchResults);
+
+    py::class_<StepFuture>(m, "StepFuture")
+        .def("done", &StepFuture::done)
+        .def("wait", &StepFuture::wait)
+        .def("__await__", [](py::object self) { return self; })
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", &StepFuture::next);
 
     py::class_<CityFlow::Archive>(m, "Archive")
-        .def(py::init<const CityFlow::Engine&>())
-        .def("dump", &CityFlow::Archive::dump, "path"_a);
+        .def(py::init([](CityFlow::Engine &engine) {
+            waitForStep(engine);
+            return CityFlow::Archive(engine);
+        }))
+        .def("dump", &CityFlow::Archive::dump, "path"_a, py::call_guard<py::gil_scoped_release>());
 #ifdef VERSION
     m.attr("__version__") = VERSION;
 #else
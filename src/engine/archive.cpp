@@ -10,7 +10,12 @@ namespace CityFlow {
     : step(engine.step), activeVehicleCount(engine.activeVehicleCount), rnd(engine.rnd),
       finishedVehicleCnt(engine.finishedVehicleCnt), cumulativeTravelTime(engine.cumulativeTravelTime) {
         // copy the vehicle Pool
-        vehiclePool = copyVehiclePool(engine.vehiclePool);
+        VehiclePool enginePool;
+        engine.vehicleRegistry.forEach([&engine, &enginePool](Vehicle *vehicle) {
+            enginePool.emplace(vehicle->getPriority(),
+                               std::make_pair(vehicle, (int) engine.vehicleRegistry.getThread(vehicle)));
+        });
+        vehiclePool = copyVehiclePool(enginePool);
 
         // record the information of each drivable object
         for (const auto &drivable : engine.roadnet.getDrivables()) {
@@ -52,9 +57,9 @@ namespace CityFlow {
             for (const auto &vehicle : lane->getWaitingBuffer()) {
                 drivableArchive.waitingBuffer.emplace_back(getNewPointer(vehiclePool, vehicle));
             }
-            drivableArchive.history = lane->history;
-            drivableArchive.historyVehicleNum = lane->historyVehicleNum;
-            drivableArchive.historyAverageSpeed = lane->historyAverageSpeed;
+            drivableArchive.history = lane->getHistory();
+            drivableArchive.historyVehicleNum = lane->getHistoryVehicleNum();
+            drivableArchive.historyAverageSpeed = lane->getHistoryAverageSpeed();
         }
 
     }
@@ -72,41 +77,39 @@ namespace CityFlow {
 
     void Archive::resume(Engine &engine) const{
         engine.step = step;
+        engine.observationStep = std::numeric_limits<size_t>::max();
         engine.activeVehicleCount = activeVehicleCount;
-        for (auto &veh : engine.vehiclePool) {
-            auto vehicle = veh.second.first;
-            delete vehicle;
+        engine.vehicleRegistry.forEach([](Vehicle *vehicle) { delete vehicle; });
+        engine.vehicleRegistry.clear();
+        engine.vehicleStore.clear();
+        VehiclePool enginePool = copyVehiclePool(vehiclePool);
+        for (const auto &pair : enginePool) {
+            Vehicle *vehicle = pair.second.first;
+            engine.vehicleRegistry.insert(vehicle, pair.second.second);
+            engine.vehicleRegistry.bindId(vehicle->getId(), vehicle);
+            if (vehicle->isRunning()) vehicle->attach(engine.vehicleStore);
         }
-        engine.vehiclePool = copyVehiclePool(vehiclePool);
-        engine.vehicleMap.clear();
-        for (const auto &iter : engine.vehiclePool) {
-            Vehicle *vehicle = iter.second.first;
-            engine.vehicleMap.emplace(vehicle->getId(), vehicle);
+        // leaders may have been attached after their followers
+        for (const auto &pair : enginePool) {
+            Vehicle *vehicle = pair.second.first;
+            if (vehicle->isRunning()) vehicle->setLeader(vehicle->controllerInfo.leader);
         }
         engine.rnd = rnd;
-        for (auto &threadVeh : engine.threadVehiclePool)
-            threadVeh.clear();
-        for (const auto &pair : engine.vehiclePool) {
-            const auto &vehicle = pair.second.first;
-            size_t threadIndex = pair.second.second;
-            engine.threadVehiclePool[threadIndex].emplace(vehicle);
-        }
         for (auto &drivable : engine.roadnet.getDrivables()) {
             const auto &archive = drivablesArchive.find(drivable)->second;
             drivable->vehicles.clear();
             for (const auto &vehicle : archive.vehicles) {
-                drivable->vehicles.emplace_back(getNewPointer(engine.vehiclePool, vehicle));
+                drivable->vehicles.push_back(getNewPointer(enginePool, vehicle));
             }
 
             if (drivable->isLane()) {
                 Lane *lane = static_cast<Lane *>(drivable);
                 lane->waitingBuffer.clear();
                 for (const auto &vehicle : archive.waitingBuffer) {
-                    lane->waitingBuffer.emplace_back(getNewPointer(engine.vehiclePool, vehicle));
+                    lane->waitingBuffer.emplace_back(getNewPointer(enginePool, vehicle));
                 }
-                lane->history = archive.history;
-                lane->historyVehicleNum = archive.historyVehicleNum;
-                lane->historyAverageSpeed = archive.historyAverageSpeed;
+                lane->setHistory(archive.history, archive.historyVehicleNum, archive.historyAverageSpeed);
+                lane->initSegments();
             }
         }
         for (auto &flow : engine.flows) {
@@ -409,11 +412,11 @@ namespace CityFlow {
             laneChangeInfo.offset = getJsonMember<double>("offset", vehicleValue);
 
             // Construct the laneChange Object
-            vehicle->laneChange = std::make_shared<SimpleLaneChange>(vehicle);
+            vehicle->laneChange = std::allocate_shared<SimpleLaneChange>(PoolAllocator<SimpleLaneChange>(), vehicle);
             auto &laneChange = vehicle->laneChange;
             rapidjson::Value::ConstMemberIterator sendItr = vehicleValue.FindMember("laneChangeUrgency");
             if (sendItr != vehicleValue.MemberEnd()) {
-                auto signal = std::make_shared<LaneChange::Signal>();
+                auto signal = std::allocate_shared<LaneChange::Signal>(PoolAllocator<LaneChange::Signal>());
                 signal->source = vehicle;
                 signal->urgency = sendItr->value.GetInt();
                 signal->direction = getJsonMember<int>("laneChangeDirection", vehicleValue);
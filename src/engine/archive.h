@@ -31,7 +31,7 @@ namespace CityFlow {
             std::list<Vehicle *> vehicles;
             std::deque<Vehicle *> waitingBuffer;
 
-            std::list<Lane::HistoryRecord> history;
+            std::vector<Lane::HistoryRecord> history;
             int    historyVehicleNum = 0;
             double historyAverageSpeed = 0;
         };
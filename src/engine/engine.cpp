@@ -1,8 +1,12 @@
 #include "engine/engine.h"
 #include "utility/utility.h"
+#include "utility/config.h"
+#include "utility/pool.h"
 
 #include <algorithm>
 #include <cmath>
+#include <deque>
+#include <unordered_map>
 #include <limits>
 #include <iostream>
 #include <memory>
@@ -10,25 +14,36 @@
 #include <ctime>
 namespace CityFlow {
 
-    Engine::Engine(const std::string &configFile, int threadNum) : threadNum(threadNum), startBarrier(threadNum + 1),
-                                                                   endBarrier(threadNum + 1) {
+    Engine::Engine(const std::string &configFile, int threadNum) : Engine(configFile, threadNum, true) { }
+
+    Engine::Engine(const std::string &configFile, int threadNum, bool spawnWorkers)
+        : vehicleRegistry(threadNum), threadNum(threadNum) {
         for (int i = 0; i < threadNum; i++) {
-            threadVehiclePool.emplace_back();
             threadRoadPool.emplace_back();
             threadIntersectionPool.emplace_back();
             threadDrivablePool.emplace_back();
+            threadVehicleList.emplace_back();
+            threadPushBuffer.emplace_back();
+            threadPositionBuffer.emplace_back();
+            laneChangeNotifyBuffer.emplace_back(threadNum);
+            threadShadowBuffer.emplace_back();
+            threadWaitingLanes.emplace_back();
+            threadRetireBuffer.emplace_back();
+            threadLaneChangeFinishBuffer.emplace_back();
         }
+        drivableQueue.reset(new WorkStealingQueue(threadNum, DRIVABLE_CHUNK_SIZE));
+        intersectionQueue.reset(new WorkStealingQueue(threadNum, INTERSECTION_CHUNK_SIZE));
+        vehicleQueue.reset(new WorkStealingQueue(threadNum, VEHICLE_CHUNK_SIZE));
         bool success = loadConfig(configFile);
         if (!success) {
             std::cerr << "load config failed!" << std::endl;
         }
 
+        buildStages();
+        if (!spawnWorkers) return;
+        stepBarrier = Barrier::create(barrierType, threadNum + 1);
         for (int i = 0; i < threadNum; i++) {
-            threadPool.emplace_back(&Engine::threadController, this,
-                                    std::ref(threadVehiclePool[i]),
-                                    std::ref(threadRoadPool[i]),
-                                    std::ref(threadIntersectionPool[i]),
-                                    std::ref(threadDrivablePool[i]));
+            threadPool.emplace_back(&Engine::threadController, this, i);
         }
 
     }
@@ -51,6 +66,11 @@ namespace CityFlow {
             warnings = false;
             rlTrafficLight = getJsonMember<bool>("rlTrafficLight", document);
             laneChange = getJsonMember<bool>("laneChange", document, false);
+            segmentLength = getJsonMember<double>("segmentLength", document, 0);
+            if (segmentLength < 0) throw std::invalid_argument("segmentLength should be positive");
+            barrierType = parseBarrierType(getJsonMember<const char*>("barrierType", document, "spin"));
+            rebalanceInterval = getJsonMember<int>("rebalanceInterval", document, 100);
+            rebalanceThreshold = getJsonMember<double>("rebalanceThreshold", document, 1.25);
             seed = getJsonMember<int>("seed", document);
             rnd.seed(seed);
             dir = getJsonMember<const char*>("dir", document);
@@ -78,29 +98,92 @@ namespace CityFlow {
         } catch (const JsonFormatError &e) {
             std::cerr << e.what() << std::endl;
             return false;
+        } catch (const std::invalid_argument &e) {
+            std::cerr << e.what() << std::endl;
+            return false;
         }
         stepLog = "";
         return true;
     }
 
     bool Engine::loadRoadNet(const std::string &jsonFile) {
-        bool ans = roadnet.loadFromJson(jsonFile);
-        int cnt = 0;
-        for (Road &road : roadnet.getRoads()) {
-            threadRoadPool[cnt].push_back(&road);
-            cnt = (cnt + 1) % threadNum;
+        bool ans = roadnet.loadFromJson(jsonFile, segmentLength);
+        partitionRoadNet();
+        return ans;
+    }
+
+    // Split the road graph into threadNum connected regions of similar size by growing them
+    // breadth-first from a seed road. A road's lanes, the lane links leaving them and most of
+    // its intersections end up on the same thread, so neighbouring vehicles share a core.
+    void Engine::partitionRoadNet() {
+        std::vector<Road> &roads = roadnet.getRoads();
+        std::unordered_map<const Road *, size_t> owner;
+        auto weight = [](Road &road) {
+            size_t w = 0;
+            for (Lane &lane : road.getLanes())
+                w += 1 + lane.getLaneLinks().size();
+            return w;
+        };
+        size_t total = 0;
+        for (Road &road : roads) total += weight(road);
+
+        size_t assigned = 0, next = 0;
+        std::deque<Road *> frontier;
+        for (int thread = 0; thread < threadNum; ++thread) {
+            size_t quota = total * (thread + 1) / threadNum;
+            frontier.clear();
+            while (assigned < quota || thread == threadNum - 1) {
+                if (frontier.empty()) {
+                    while (next < roads.size() && owner.count(&roads[next])) ++next;
+                    if (next == roads.size()) break;
+                    owner[&roads[next]] = thread;
+                    frontier.push_back(&roads[next]);
+                }
+                Road *road = frontier.front();
+                frontier.pop_front();
+                threadRoadPool[thread].push_back(road);
+                assigned += weight(*road);
+                for (const Intersection *intersection : {&road->getEndIntersection(), &road->getStartIntersection()})
+                    for (Road *neighbour : intersection->getRoads())
+                        if (!owner.count(neighbour)) {
+                            owner[neighbour] = thread;
+                            frontier.push_back(neighbour);
+                        }
+            }
+            // roads reached but not taken are given back to the next region
+            for (Road *road : frontier) owner.erase(road);
         }
-        for (Intersection &intersection : roadnet.getIntersections()) {
-            threadIntersectionPool[cnt].push_back(&intersection);
-            cnt = (cnt + 1) % threadNum;
+        assignRoadPools();
+    }
+
+    void Engine::assignRoadPools() {
+        roadThread.assign(roadnet.getRoads().size(), 0);
+        for (int thread = 0; thread < threadNum; ++thread) {
+            threadDrivablePool[thread].clear();
+            threadIntersectionPool[thread].clear();
+            for (Road *road : threadRoadPool[thread]) {
+                roadThread[getRoadIndex(road)] = thread;
+                for (Lane &lane : road->getLanes()) {
+                    threadDrivablePool[thread].push_back(&lane);
+                    for (LaneLink *laneLink : lane.getLaneLinks())
+                        threadDrivablePool[thread].push_back(laneLink);
+                }
+            }
         }
-        for (Drivable *drivable : roadnet.getDrivables()) {
-            threadDrivablePool[cnt].push_back(drivable);
-            cnt = (cnt + 1) % threadNum;
+#ifndef NDEBUG
+        size_t drivableCount = 0;
+        for (const auto &drivables : threadDrivablePool) drivableCount += drivables.size();
+        assert(drivableCount == roadnet.getDrivables().size());
+#endif
+
+        // an intersection goes to the thread owning most of its roads
+        for (Intersection &intersection : roadnet.getIntersections()) {
+            std::vector<size_t> votes(threadNum, 0);
+            for (Road *road : intersection.getRoads())
+                votes[roadThread[getRoadIndex(road)]]++;
+            size_t thread = std::max_element(votes.begin(), votes.end()) - votes.begin();
+            threadIntersectionPool[thread].push_back(&intersection);
         }
-        jsonRoot.SetObject();
-        jsonRoot.AddMember("static", roadnet.convertToJson(jsonRoot.GetAllocator()), jsonRoot.GetAllocator());
-        return ans;
     }
 
     bool Engine::loadFlow(const std::string &jsonFilename) {
@@ -185,7 +268,7 @@ namespace CityFlow {
         return result;
     }
 
-    void Engine::vehicleControl(Vehicle &vehicle, std::vector<std::pair<Vehicle *, double>> &buffer) {
+    void Engine::vehicleControl(Vehicle &vehicle, size_t threadIndex) {
         double nextSpeed;
         if (vehicle.hasSetSpeed())
             nextSpeed = vehicle.getBufferSpeed();
@@ -234,9 +317,8 @@ namespace CityFlow {
                 vehicle.setOffset(newOffset * dir);
 
                 if (newOffset >= vehicle.getMaxOffset()) {
-                    std::lock_guard<std::mutex> guard(lock);
-                    vehicleMap.erase(vehicle.getPartner()->getId());
-                    vehicleMap[vehicle.getId()] = vehicle.getPartner();
+                    Vehicle *partner = vehicle.getPartner();
+                    threadLaneChangeFinishBuffer[threadIndex].emplace_back(partner, partner->getId());
                     vehicle.finishChanging();
                 }
 
@@ -245,176 +327,274 @@ namespace CityFlow {
 
 
         if (!vehicle.hasSetEnd() && vehicle.hasSetDrivable()) {
-            buffer.emplace_back(&vehicle, vehicle.getBufferDis());
+            threadPushBuffer[threadIndex].push_back({vehicle.getChangedDrivable(), vehicle.getBufferDis(), &vehicle});
         }
 
     }
 
-    void Engine::threadController(std::set<Vehicle *> &vehicles, 
-                                  std::vector<Road *> &roads,
-                                  std::vector<Intersection *> &intersections,
-                                  std::vector<Drivable *> &drivables) {
-        while (!finished) {
-            threadPlanRoute(roads);
-            if (laneChange) {
-                threadInitSegments(roads);
-                threadPlanLaneChange(vehicles);
-                threadUpdateLeaderAndGap(drivables);
+    void Engine::buildStages() {
+        stages.clear();
+        stages.push_back({[this](size_t i) { threadPlanRoute(i); },
+                          [this]() {
+                              planRoute();
+                              handleWaiting();
+                              // every vehicle may start a lane change, the shadows get their slots in parallel
+                              if (laneChange) vehicleStore.reserve(activeVehicleCount);
+                          }});
+        if (laneChange) {
+            stages.push_back({[this](size_t i) { threadPlanLaneChange(i); }, nullptr});
+            stages.push_back({[this](size_t i) { threadScheduleLaneChange(i); },
+                              [this]() { insertShadows(); }});
+            stages.push_back({[this](size_t i) { threadUpdateLeaderAndGap(i); }, nullptr});
+        }
+        stages.push_back({[this](size_t i) { threadNotifyCross(i); }, nullptr});
+        stages.push_back({[this](size_t i) { threadGetAction(i); }, nullptr});
+        stages.push_back({[this](size_t i) { threadUpdateLocation(i); },
+                          [this]() { retireVehicles(); }});
+        stages.push_back({[this](size_t i) { threadUpdateAction(i); }, nullptr});
+        // traffic lights are not read while leaders are updated, so they advance in the same stage
+        stages.push_back({[this](size_t i) {
+            threadUpdateLeaderAndGap(i, true);
+            if (!rlTrafficLight) threadPassTime(threadIntersectionPool[i]);
+        }, nullptr});
+        // subscribed observations are taken last, once nothing moves any more
+        if (!observations.empty()) {
+            stages.back().serial = [this]() { prepareObservations(); };
+            stages.push_back({[this](size_t i) { threadObserve(i); }, nullptr});
+        }
+    }
+
+    void Engine::threadController(size_t threadIndex) {
+        Barrier::setParticipantId(threadIndex);
+        while (true) {
+            stepBarrier->wait();
+            if (finished) break;
+            // stages may be rebuilt once the step is over, so they are not read after the last wait
+            size_t stageNum = stages.size();
+            for (size_t i = 0; i < stageNum; ++i) {
+                const Stage &stage = stages[i];
+                bool serial = static_cast<bool>(stage.serial);
+                stage.work(threadIndex);
+                stepBarrier->wait();
+                if (serial) stepBarrier->wait();
             }
-            threadNotifyCross(intersections);
-            threadGetAction(vehicles);
-            threadUpdateLocation(drivables);
-            threadUpdateAction(vehicles);
-            threadUpdateLeaderAndGap(drivables);
         }
     }
 
-    void Engine::threadPlanRoute(const std::vector<Road *> &roads) {
-        startBarrier.wait();
-        for (auto &road : roads) {
+    void Engine::runStages() {
+        if (threadPool.empty()) {
+            for (const Stage &stage : stages) {
+                stage.work(0);
+                if (stage.serial) stage.serial();
+            }
+            return;
+        }
+        Barrier::setParticipantId(threadNum);
+        stepBarrier->wait();
+        for (const Stage &stage : stages) {
+            stepBarrier->wait();
+            if (stage.serial) {
+                stage.serial();
+                stepBarrier->wait();
+            }
+        }
+    }
+
+    void Engine::threadPlanRoute(size_t threadIndex) {
+        std::vector<Lane *> &waitingLanes = threadWaitingLanes[threadIndex];
+        for (Road *road : threadRoadPool[threadIndex]) {
             for (auto &vehicle : road->getPlanRouteBuffer()) {
                 vehicle->updateRoute();
             }
+
+            // waiting buffers only change in the serial part, lanes that were empty are checked by planRoute
+            for (Lane &lane : road->getLanes()) {
+                auto &buffer = lane.getWaitingBuffer();
+                if (!buffer.empty() && lane.available(buffer.front()))
+                    waitingLanes.push_back(&lane);
+            }
         }
-        endBarrier.wait();
     }
 
-    void Engine::threadUpdateLocation(const std::vector<Drivable *> &drivables) {
-        startBarrier.wait();
-        for (Drivable *drivable : drivables) {
-            auto &vehicles   = drivable->getVehicles();
-            auto vehicleItr = vehicles.begin();
-            while (vehicleItr != vehicles.end()) {
-                Vehicle *vehicle = *vehicleItr;
-
-                if ((vehicle->getChangedDrivable()) != nullptr || vehicle->hasSetEnd()) {
-                    vehicleItr = vehicles.erase(vehicleItr);
-                }else{
-                    vehicleItr++;
-                }
+    void Engine::collectThreadVehicles(size_t threadIndex) {
+        std::vector<Vehicle *> &list = threadVehicleList[threadIndex];
+        list.clear();
+        for (Vehicle *vehicle : vehicleRegistry.getThreadVehicles(threadIndex))
+            if (vehicle->isReal()) list.push_back(vehicle);
+    }
 
+    void Engine::threadUpdateLocation(size_t threadIndex) {
+        std::vector<Vehicle *> &retired = threadRetireBuffer[threadIndex];
+        std::vector<DrivableChange> incoming;
+        drivableQueue->forEach(threadIndex, threadDrivablePool, [this, &retired, &incoming](Drivable *drivable) {
+            auto leaves = [&retired](Vehicle *vehicle) {
                 if (vehicle->hasSetEnd()) {
-                    std::lock_guard<std::mutex> guard(lock);
-                    vehicleRemoveBuffer.insert(vehicle);
-                    if (!vehicle->getLaneChange()->hasFinished()) {
-                        vehicleMap.erase(vehicle->getId());
-                        finishedVehicleCnt += 1;
-                        cumulativeTravelTime += getCurrentTime() - vehicle->getEnterTime();
-                    }
-                    auto iter = vehiclePool.find(vehicle->getPriority());
-                    threadVehiclePool[iter->second.second].erase(vehicle);
-//                    assert(vehicle->getPartner() == nullptr);
-                    delete vehicle;
-                    vehiclePool.erase(iter);
-                    activeVehicleCount--;
+                    retired.push_back(vehicle);
+                    return true;
                 }
+                return vehicle->getChangedDrivable() != nullptr;
+            };
+            // lane changes look partners up by segment, the ranges follow the vehicles here
+            if (laneChange && drivable->isLane())
+                static_cast<Lane *>(drivable)->eraseVehiclesIf(leaves);
+            else
+                drivable->getVehicles().eraseIf(leaves);
+            insertVehicles(drivable, incoming);
+        });
+    }
 
+    void Engine::insertVehicles(Drivable *drivable, std::vector<DrivableChange> &incoming) {
+        // every thread holds a sorted run of the vehicles it moved onto this drivable
+        incoming.clear();
+        DrivableChange key{drivable, 0, nullptr};
+        auto sameDrivable = [](const DrivableChange &a, const DrivableChange &b) {
+            return std::less<Drivable *>()(a.drivable, b.drivable);
+        };
+        for (auto &buffer : threadPushBuffer) {
+            auto range = std::equal_range(buffer.begin(), buffer.end(), key, sameDrivable);
+            if (range.first == range.second) continue;
+            size_t middle = incoming.size();
+            incoming.insert(incoming.end(), range.first, range.second);
+            std::inplace_merge(incoming.begin(), incoming.begin() + middle, incoming.end(), drivableChangeCmp);
+        }
+        for (auto &change : incoming) {
+            if (laneChange && drivable->isLane())
+                static_cast<Lane *>(drivable)->pushVehicleToSegment(change.vehicle);
+            else
+                drivable->pushVehicle(change.vehicle);
+            if (drivable->isLaneLink()) {
+                change.vehicle->setEnterLaneLinkTime(step);
+            } else {
+                change.vehicle->setEnterLaneLinkTime(std::numeric_limits<int>::max());
             }
         }
-        endBarrier.wait();
     }
 
-    void Engine::threadNotifyCross(const std::vector<Intersection *> &intersections) {
-        //TODO: iterator for laneLink
-        startBarrier.wait();
-        for (Intersection *intersection : intersections)
-            for (Cross &cross : intersection->getCrosses())
-                cross.clearNotify();
+    void Engine::threadNotifyCross(size_t threadIndex) {
+        intersectionQueue->forEach(threadIndex, threadIntersectionPool, [this](Intersection *intersection) {
+            notifyCross(intersection);
+        });
+
+        // Leaders and gaps are settled by now, car following of the whole step is computed in
+        // bulk. The scalar switch leaves it to Vehicle::getCarFollowSpeed, one vehicle at a time.
+        if (scalarCarFollow) return;
+        size_t slots = vehicleStore.size();
+        vehicleStore.computeCarFollowSpeed(slots * threadIndex / threadNum, slots * (threadIndex + 1) / threadNum,
+                                           interval, getSimdLevel());
+    }
 
-        for (Intersection *intersection : intersections)
-            for (LaneLink *laneLink : intersection->getLaneLinks()) {
-                // XXX: no cross in laneLink?
-                const auto &crosses = laneLink->getCrosses();
-                auto rIter = crosses.rbegin();
-
-                // first check the vehicle on the end lane
-                Vehicle *vehicle = laneLink->getEndLane()->getLastVehicle();
-                if (vehicle && static_cast<LaneLink *>(vehicle->getPrevDrivable()) == laneLink) {
-                    double vehDistance = vehicle->getDistance() - vehicle->getLen();
-                    while (rIter != crosses.rend()) {
-                        double crossDistance = laneLink->getLength() - (*rIter)->getDistanceByLane(laneLink);
-                        if (crossDistance + vehDistance < (*rIter)->getLeaveDistance()) {
-                            (*rIter)->notify(laneLink, vehicle, -(vehicle->getDistance() + crossDistance));
-                            ++rIter;
-                        } else break;
-                    }
+    void Engine::notifyCross(Intersection *intersection) {
+        // crosses are shared only by lane links of the same intersection
+        //TODO: iterator for laneLink
+        for (Cross &cross : intersection->getCrosses())
+            cross.clearNotify();
+
+        for (LaneLink *laneLink : intersection->getLaneLinks()) {
+            // XXX: no cross in laneLink?
+            const auto &crosses = laneLink->getCrosses();
+            auto rIter = crosses.rbegin();
+
+            // first check the vehicle on the end lane
+            Vehicle *vehicle = laneLink->getEndLane()->getLastVehicle();
+            if (vehicle && static_cast<LaneLink *>(vehicle->getPrevDrivable()) == laneLink) {
+                double vehDistance = vehicle->getDistance() - vehicle->getLen();
+                while (rIter != crosses.rend()) {
+                    double crossDistance = laneLink->getLength() - (*rIter)->getDistanceByLane(laneLink);
+                    if (crossDistance + vehDistance < (*rIter)->getLeaveDistance()) {
+                        (*rIter)->notify(laneLink, vehicle, -(vehicle->getDistance() + crossDistance));
+                        ++rIter;
+                    } else break;
                 }
+            }
+
+            // check each vehicle on laneLink
+            for (Vehicle *linkVehicle : laneLink->getVehicles()) {
+                double vehDistance = linkVehicle->getDistance();
 
-                // check each vehicle on laneLink
-                for (Vehicle *linkVehicle : laneLink->getVehicles()) {
-                    double vehDistance = linkVehicle->getDistance();
-
-                    while (rIter != crosses.rend()) {
-                        double crossDistance = (*rIter)->getDistanceByLane(laneLink);
-                        if (vehDistance > crossDistance) {
-                            if (vehDistance - crossDistance - linkVehicle->getLen() <=
-                                (*rIter)->getLeaveDistance()) {
-                                (*rIter)->notify(laneLink, linkVehicle, crossDistance - vehDistance);
-                            } else break;
-                        } else {
+                while (rIter != crosses.rend()) {
+                    double crossDistance = (*rIter)->getDistanceByLane(laneLink);
+                    if (vehDistance > crossDistance) {
+                        if (vehDistance - crossDistance - linkVehicle->getLen() <=
+                            (*rIter)->getLeaveDistance()) {
                             (*rIter)->notify(laneLink, linkVehicle, crossDistance - vehDistance);
-                        }
-                        ++rIter;
+                        } else break;
+                    } else {
+                        (*rIter)->notify(laneLink, linkVehicle, crossDistance - vehDistance);
                     }
+                    ++rIter;
                 }
+            }
 
-                // check vehicle on the incoming lane
-                vehicle = laneLink->getStartLane()->getFirstVehicle();
-                if (vehicle && static_cast<LaneLink *>(vehicle->getNextDrivable()) == laneLink && laneLink->isAvailable()) {
-                    double vehDistance = laneLink->getStartLane()->getLength() - vehicle->getDistance();
-                    while (rIter != crosses.rend()) {
-                        (*rIter)->notify(laneLink, vehicle, vehDistance + (*rIter)->getDistanceByLane(laneLink));
-                        ++rIter;
-                    }
+            // check vehicle on the incoming lane
+            vehicle = laneLink->getStartLane()->getFirstVehicle();
+            if (vehicle && static_cast<LaneLink *>(vehicle->getNextDrivable()) == laneLink && laneLink->isAvailable()) {
+                double vehDistance = laneLink->getStartLane()->getLength() - vehicle->getDistance();
+                while (rIter != crosses.rend()) {
+                    (*rIter)->notify(laneLink, vehicle, vehDistance + (*rIter)->getDistanceByLane(laneLink));
+                    ++rIter;
                 }
             }
-        endBarrier.wait();
+        }
     }
 
-    void Engine::threadPlanLaneChange(const std::set<CityFlow::Vehicle *> &vehicles) {
-        startBarrier.wait();
-        std::vector<CityFlow::Vehicle *> buffer;
+    void Engine::threadPlanLaneChange(size_t threadIndex) {
+        // a lane change only touches the lanes of its own road, so it is scheduled by the road owner
+        std::vector<std::vector<Vehicle *>> &buffer = laneChangeNotifyBuffer[threadIndex];
 
-        for (auto vehicle : vehicles)
+        forEachVehicle(threadIndex, [this, &buffer](Vehicle *vehicle) {
             if (vehicle->isRunning() && vehicle->isReal()) {
                 vehicle->makeLaneChangeSignal(interval);
                 if (vehicle->planLaneChange()){
-                    buffer.emplace_back(vehicle);
+                    Drivable *drivable = vehicle->getCurDrivable();
+                    Lane *lane = drivable->isLane() ? static_cast<Lane *>(drivable)
+                                                    : static_cast<LaneLink *>(drivable)->getStartLane();
+                    buffer[roadThread[getRoadIndex(lane->getBelongRoad())]].emplace_back(vehicle);
                 }
             }
-        {
-            std::lock_guard<std::mutex> guard(lock);
-            laneChangeNotifyBuffer.insert(laneChangeNotifyBuffer.end(), buffer.begin(), buffer.end());
-        }
-        endBarrier.wait();
+        });
     }
 
-    void Engine::threadInitSegments(const std::vector<Road *> &roads) {
-        startBarrier.wait();
-        for (Road *road : roads)
-            for (Lane &lane : road->getLanes()) {
-                lane.initSegments();
+    void Engine::threadScheduleLaneChange(size_t threadIndex) {
+        std::vector<Vehicle *> candidates;
+        for (auto &buffer : laneChangeNotifyBuffer) {
+            candidates.insert(candidates.end(), buffer[threadIndex].begin(), buffer[threadIndex].end());
+            buffer[threadIndex].clear();
+        }
+        std::sort(candidates.begin(), candidates.end(), [](Vehicle *a, Vehicle *b) {
+            if (a->laneChangeUrgency() != b->laneChangeUrgency())
+                return a->laneChangeUrgency() > b->laneChangeUrgency();
+            return a->getPriority() < b->getPriority();
+        });
+        for (auto v : candidates) {
+            v->updateLaneChangeNeighbor();
+            v->sendSignal();
+            // Lane Change
+            // Insert a shadow vehicle
+            if (v->planLaneChange() && v->canChange() && !v->isChanging()) {
+                std::shared_ptr<LaneChange> lc = v->getLaneChange();
+                if (lc->isGapValid() && v->getCurDrivable()->isLane()) {
+                    Vehicle *shadow = new Vehicle(*v, v->getId() + "_shadow", this);
+                    shadow->attach(vehicleStore);
+                    v->insertShadow(shadow);
+                    threadShadowBuffer[threadIndex].push_back(shadow);
+                }
             }
-        endBarrier.wait();
+        }
     }
 
 
-    void Engine::threadGetAction(std::set<Vehicle *> &vehicles) {
-        startBarrier.wait();
-        std::vector<std::pair<Vehicle *, double>> buffer;
-        for (auto vehicle: vehicles)
-            if (vehicle->isRunning()) 
-                vehicleControl(*vehicle, buffer);
-        {
-            std::lock_guard<std::mutex> guard(lock);
-            pushBuffer.insert(pushBuffer.end(), buffer.begin(), buffer.end());
-        }
-        endBarrier.wait();
+    void Engine::threadGetAction(size_t threadIndex) {
+        std::vector<DrivableChange> &buffer = threadPushBuffer[threadIndex];
+        buffer.clear();
+        forEachVehicle(threadIndex, [this, threadIndex](Vehicle *vehicle) {
+            if (vehicle->isRunning())
+                vehicleControl(*vehicle, threadIndex);
+        });
+        std::sort(buffer.begin(), buffer.end(), drivableChangeCmp);
     }
 
-    void Engine::threadUpdateAction(std::set<Vehicle *> &vehicles) {
-        startBarrier.wait();
-        for (auto vehicle: vehicles)
+    void Engine::threadUpdateAction(size_t threadIndex) {
+        forEachVehicle(threadIndex, [this](Vehicle *vehicle) {
             if (vehicle->isRunning()) {
                 if (vehicleRemoveBuffer.count(vehicle->getBufferBlocker())){
                     vehicle->setBlocker(nullptr);
@@ -423,109 +603,300 @@ namespace CityFlow {
                 vehicle->update();
                 vehicle->clearSignal();
             }
-        endBarrier.wait();
+        });
     }
 
-    void Engine::threadUpdateLeaderAndGap(const std::vector<Drivable *> &drivables) {
-        startBarrier.wait();
-        for (Drivable *drivable : drivables) {
+    void Engine::threadUpdateLeaderAndGap(size_t threadIndex, bool lastUpdate) {
+        bool countVehicleState = lastUpdate && observations.isSubscribed(ObservationDomain::VEHICLE);
+        drivableQueue->forEach(threadIndex, threadDrivablePool, [this, countVehicleState](Drivable *drivable) {
             Vehicle *leader = nullptr;
             for (Vehicle *vehicle : drivable->getVehicles()) {
                 vehicle->updateLeaderAndGap(leader);
                 leader = vehicle;
             }
+            if (countVehicleState)
+                vehicleStateOffset[drivable->getRoadnetIndex()] = countRealVehicles(drivable);
             if (drivable->isLane()){
                 static_cast<Lane *>(drivable)->updateHistory();
             }
+        });
+    }
+
+    void Engine::threadObserve(size_t threadIndex) {
+        bool lanes = observations.isSubscribed(ObservationDomain::LANE);
+        bool vehicles = observations.isSubscribed(ObservationDomain::VEHICLE);
+        if (lanes || vehicles) {
+            PositionBuffer &buffer = threadPositionBuffer[threadIndex];
+            drivableQueue->forEach(threadIndex, threadDrivablePool, [&](Drivable *drivable) {
+                if (lanes && drivable->isLane()) updateLaneMetrics(static_cast<Lane *>(drivable));
+                if (vehicles) fillVehicleState(drivable, buffer);
+            });
+        }
+        if (observations.isSubscribed(ObservationDomain::ROAD)) {
+            for (Road *road : threadRoadPool[threadIndex])
+                updateRoadMetrics(road);
+        }
+        if (observations.isSubscribed(ObservationDomain::INTERSECTION)) {
+            intersectionQueue->forEach(threadIndex, threadIntersectionPool, [this](Intersection *intersection) {
+                updateIntersectionMetrics(intersection);
+            });
+        }
+    }
+
+    void Engine::observe() {
+        if (observationStep == step) return;
+        if (observations.isSubscribed(ObservationDomain::VEHICLE)) {
+            for (const Drivable *drivable : roadnet.getDrivables())
+                vehicleStateOffset[drivable->getRoadnetIndex()] = countRealVehicles(drivable);
+        }
+        prepareObservations();
+        if (observations.isSubscribed(ObservationDomain::VEHICLE)) {
+            for (const Drivable *drivable : roadnet.getDrivables())
+                fillVehicleState(drivable, threadPositionBuffer[0]);
+        }
+        if (observations.isSubscribed(ObservationDomain::LANE)) {
+            for (const Lane *lane : roadnet.getLanes())
+                updateLaneMetrics(lane);
         }
-        endBarrier.wait();
+        if (observations.isSubscribed(ObservationDomain::ROAD)) {
+            for (const Road &road : roadnet.getRoads())
+                updateRoadMetrics(&road);
+        }
+        if (observations.isSubscribed(ObservationDomain::INTERSECTION)) {
+            for (Intersection &intersection : roadnet.getIntersections())
+                updateIntersectionMetrics(&intersection);
+        }
+        observationStep = step;
     }
 
-    void Engine::planLaneChange() {
-        startBarrier.wait();
-        endBarrier.wait();
-        scheduleLaneChange();
+    void Engine::updateLaneMetrics(const Lane *lane) {
+        size_t index = lane->getRoadnetIndex();
+        size_t count = lane->getVehicleCount();
+        int waiting = 0;
+        double speedSum = 0, lengthSum = 0;
+        for (const Vehicle *vehicle : lane->getVehicles()) {
+            if (isWaiting(vehicle)) waiting += 1;
+            speedSum += vehicle->getSpeed();
+            lengthSum += vehicle->getLen();
+        }
+        laneMetrics->vehicleCount[index] = static_cast<int>(count);
+        laneMetrics->waitingVehicleCount[index] = waiting;
+        laneMetrics->meanSpeed[index] = count > 0 ? speedSum / count : 0;
+        laneMetrics->occupancy[index] = lengthSum / lane->getLength();
+    }
+
+    void Engine::updateRoadMetrics(const Road *road) {
+        size_t index = getRoadIndex(road);
+        int count = 0, waiting = 0;
+        double speedSum = 0;
+        for (const Lane &lane : road->getLanes()) {
+            for (const Vehicle *vehicle : lane.getVehicles()) {
+                count += 1;
+                if (isWaiting(vehicle)) waiting += 1;
+                speedSum += vehicle->getSpeed();
+            }
+        }
+        roadMetrics->vehicleCount[index] = count;
+        roadMetrics->waitingVehicleCount[index] = waiting;
+        roadMetrics->meanSpeed[index] = count > 0 ? speedSum / count : 0;
+    }
+
+    void Engine::updateIntersectionMetrics(Intersection *intersection) {
+        size_t index = getIntersectionIndex(intersection);
+        int waiting = 0;
+        for (const Road *road : intersection->getRoads()) {
+            if (&road->getEndIntersection() != intersection) continue;
+            for (const Lane &lane : road->getLanes())
+                for (const Vehicle *vehicle : lane.getVehicles())
+                    if (isWaiting(vehicle)) waiting += 1;
+        }
+        intersectionMetrics->phase[index] = intersection->getTrafficLight().getCurrentPhaseIndex();
+        intersectionMetrics->waitingVehicleCount[index] = waiting;
+    }
+
+    void Engine::prepareObservations() {
+        if (observations.isSubscribed(ObservationDomain::LANE)) replaceIfHeld(laneMetrics);
+        if (observations.isSubscribed(ObservationDomain::ROAD)) replaceIfHeld(roadMetrics);
+        if (observations.isSubscribed(ObservationDomain::INTERSECTION)) replaceIfHeld(intersectionMetrics);
+        if (observations.isSubscribed(ObservationDomain::VEHICLE)) layoutVehicleState();
+    }
+
+    size_t Engine::countRealVehicles(const Drivable *drivable) {
+        size_t count = 0;
+        for (const Vehicle *vehicle : drivable->getVehicles())
+            if (vehicle->isReal()) count += 1;
+        return count;
+    }
+
+    // turns the row count of each drivable into its first row
+    void Engine::layoutVehicleState() {
+        if (!vehicleState || vehicleState.use_count() > 1)
+            vehicleState = std::make_shared<VehicleStateColumns>();
+        size_t rows = 0;
+        for (size_t &offset : vehicleStateOffset) {
+            size_t count = offset;
+            offset = rows;
+            rows += count;
+        }
+        vehicleState->resize(rows);
+    }
+
+    void Engine::PositionBuffer::lookup(const Drivable *drivable) {
+        distances.clear();
+        for (const Vehicle *vehicle : drivable->getVehicles())
+            distances.push_back(vehicle->getDistance());
+        points.resize(distances.size());
+        directions.resize(distances.size());
+        drivable->getPointsByDistances(distances.data(), distances.size(), points.data(), directions.data());
+    }
+
+    void Engine::fillVehicleState(const Drivable *drivable, PositionBuffer &buffer) {
+        const VehicleArray &vehicles = drivable->getVehicles();
+        if (vehicles.empty()) return;
+        if (observeVehiclePositions) buffer.lookup(drivable);
+        VehicleStateColumns &state = *vehicleState;
+        int drivableIndex = static_cast<int>(drivable->getRoadnetIndex());
+        int roadIndex = drivable->isLane()
+                ? static_cast<int>(getRoadIndex(static_cast<const Lane *>(drivable)->getBelongRoad())) : -1;
+        size_t row = vehicleStateOffset[drivableIndex];
+        for (size_t i = 0; i < vehicles.size(); ++i) {
+            const Vehicle *vehicle = vehicles[i];
+            if (!vehicle->isReal()) continue;
+            if (observeVehiclePositions) {
+                Point pos = fabs(vehicle->getOffset()) < eps ? buffer.points[i] : vehicle->getPoint();
+                const Point &dir = buffer.directions[i];
+                state.x[row] = pos.x;
+                state.y[row] = pos.y;
+                state.heading[row] = atan2(dir.y, dir.x);
+            }
+            state.handle[row] = vehicleRegistry.getHandle(vehicle);
+            state.speed[row] = vehicle->getSpeed();
+            state.distance[row] = vehicle->getDistance();
+            state.drivableIndex[row] = drivableIndex;
+            state.roadIndex[row] = roadIndex;
+            state.laneChangeDirection[row] = vehicle->lastLaneChangeDirection();
+            state.enterTime[row] = vehicle->getEnterTime();
+            ++row;
+        }
+    }
+
+    void Engine::threadPassTime(const std::vector<Intersection *> &intersections) {
+        for (Intersection *intersection : intersections)
+            intersection->getTrafficLight().passTime(interval);
     }
 
     void Engine::planRoute() {
-        startBarrier.wait();
-        endBarrier.wait();
+        // the first lane is drawn from rnd, so it is picked here in road network order
         for (auto &road : roadnet.getRoads()) {
             for (auto &vehicle : road.getPlanRouteBuffer())
                 if (vehicle->isRouteValid()) {
                     vehicle->setFirstDrivable();
-                    vehicle->getCurLane()->pushWaitingVehicle(vehicle);
+                    Lane *lane = vehicle->getCurLane();
+                    lane->pushWaitingVehicle(vehicle);
+                    if (lane->getWaitingBuffer().size() == 1 && lane->available(vehicle))
+                        threadWaitingLanes[roadThread[getRoadIndex(&road)]].push_back(lane);
                 }else {
                     Flow *flow = vehicle->getFlow();
                     if (flow) flow->setValid(false);
 
                     //remove this vehicle
-                    auto iter = vehiclePool.find(vehicle->getPriority());
-                    threadVehiclePool[iter->second.second].erase(vehicle);
+                    vehicleRegistry.unbindId(vehicle->getId());
+                    vehicleRegistry.erase(vehicle);
                     delete vehicle;
-                    vehiclePool.erase(iter);
                 }
             road.clearPlanRouteBuffer();
         }
     }
 
-    void Engine::getAction() {
-        startBarrier.wait();
-        endBarrier.wait();
-    }
-
-    void Engine::updateLocation() {
-        startBarrier.wait();
-        endBarrier.wait();
-        std::sort(pushBuffer.begin(), pushBuffer.end(), vehicleCmp);
-        for (auto &vehiclePair : pushBuffer) {
-            Vehicle *vehicle = vehiclePair.first;
-            Drivable *drivable = vehicle->getChangedDrivable();
-            if (drivable != nullptr) {
-                drivable->pushVehicle(vehicle);
-                if (drivable->isLaneLink()) {
-                    vehicle->setEnterLaneLinkTime(step);
-                } else {
-                    vehicle->setEnterLaneLinkTime(std::numeric_limits<int>::max());
-                }
+    void Engine::retireVehicles() {
+        for (auto &buffer : threadLaneChangeFinishBuffer) {
+            for (auto &finished : buffer) {
+                // the shadow goes on with the id and the handle of the vehicle it replaces
+                Vehicle *shadow = finished.first;
+                Vehicle *original = vehicleRegistry.findById(shadow->getId());
+                if (original && original != shadow) vehicleRegistry.swapSlots(original, shadow);
+                vehicleRegistry.unbindId(finished.second);
+                vehicleRegistry.bindId(shadow->getId(), shadow);
             }
+            buffer.clear();
         }
-        pushBuffer.clear();
-    }
 
-    void Engine::updateAction() {
-        startBarrier.wait();
-        endBarrier.wait();
-        vehicleRemoveBuffer.clear();
+        std::vector<Vehicle *> retired;
+        for (auto &buffer : threadRetireBuffer) {
+            retired.insert(retired.end(), buffer.begin(), buffer.end());
+            buffer.clear();
+        }
+        // travel times are summed in priority order so the total does not depend on the threads
+        std::sort(retired.begin(), retired.end(), [](Vehicle *a, Vehicle *b) {
+            return a->getPriority() < b->getPriority();
+        });
+        for (Vehicle *vehicle : retired) {
+            vehicleRemoveBuffer.insert(vehicle);
+            if (vehicle->getLaneChange()->hasFinished()) {
+                vehicle->getLaneChange()->clearSignal();
+            } else {
+                vehicleRegistry.unbindId(vehicle->getId());
+                finishedVehicleCnt += 1;
+                cumulativeTravelTime += getCurrentTime() - vehicle->getEnterTime();
+            }
+            vehicleRegistry.erase(vehicle);
+            activeVehicleCount--;
+        }
     }
 
     void Engine::handleWaiting() {
-        for (Lane *lane : roadnet.getLanes()) {
+        std::vector<Lane *> lanes;
+        for (auto &waitingLanes : threadWaitingLanes) {
+            lanes.insert(lanes.end(), waitingLanes.begin(), waitingLanes.end());
+            waitingLanes.clear();
+        }
+        // a vehicle entering an empty lane looks for its leader on the lanes ahead,
+        // so admit them in road network order whatever the partition is
+        std::sort(lanes.begin(), lanes.end(), [this](Lane *a, Lane *b) {
+            size_t roadA = getRoadIndex(a->getBelongRoad()), roadB = getRoadIndex(b->getBelongRoad());
+            return roadA != roadB ? roadA < roadB : a->getLaneIndex() < b->getLaneIndex();
+        });
+        for (Lane *lane : lanes) {
             auto &buffer = lane->getWaitingBuffer();
-            if (buffer.empty()) continue;
             auto &vehicle = buffer.front();
-            if (lane->available(vehicle)) {
-                vehicle->setRunning(true);
-                activeVehicleCount += 1;
-                Vehicle * tail = lane->getLastVehicle();
+            vehicle->setRunning(true);
+            vehicleRegistry.setRunning(vehicle);
+            activeVehicleCount += 1;
+            vehicle->attach(vehicleStore);
+            Vehicle * tail = lane->getLastVehicle();
+            if (laneChange)
+                lane->pushVehicleToSegment(vehicle);
+            else
                 lane->pushVehicle(vehicle);
-                vehicle->updateLeaderAndGap(tail);
-                buffer.pop_front();
-            }
+            vehicle->updateLeaderAndGap(tail);
+            buffer.pop_front();
         }
     }
 
     void Engine::updateLog() {
         std::string result;
-        for (const Vehicle* vehicle: getRunningVehicles()) {
-            Point pos = vehicle->getPoint();
-            Point dir = vehicle->getCurDrivable()->getDirectionByDistance(vehicle->getDistance());
-
-            int lc = vehicle->lastLaneChangeDirection();
-            result.append(
-                    double2string(pos.x) + " " + double2string(pos.y) + " " + double2string(atan2(dir.y, dir.x)) + " "
-                            + vehicle->getId() + " " + std::to_string(lc) + " " + double2string(vehicle->getLen()) + " "
-                            + double2string(vehicle->getWidth()) + ",");
+        // positions are looked up drivable by drivable, in lane order
+        PositionBuffer &buffer = threadPositionBuffer[0];
+        for (const Drivable *drivable : roadnet.getDrivables()) {
+            const VehicleArray &vehicles = drivable->getVehicles();
+            if (vehicles.empty()) continue;
+            buffer.lookup(drivable);
+
+            for (size_t i = 0; i < vehicles.size(); ++i) {
+                const Vehicle *vehicle = vehicles[i];
+                if (!vehicle->isReal()) continue;
+                Point pos = fabs(vehicle->getOffset()) < eps ? buffer.points[i] : vehicle->getPoint();
+                const Point &dir = buffer.directions[i];
+
+                int lc = vehicle->lastLaneChangeDirection();
+                result.append(double2string(pos.x)).append(" ")
+                      .append(double2string(pos.y)).append(" ")
+                      .append(double2string(atan2(dir.y, dir.x))).append(" ")
+                      .append(vehicle->getId()).append(" ")
+                      .append(std::to_string(lc)).append(" ")
+                      .append(double2string(vehicle->getLen())).append(" ")
+                      .append(double2string(vehicle->getWidth())).append(",");
+            }
         }
         result.append(";");
 
@@ -553,37 +924,18 @@ namespace CityFlow {
         logOut << result << std::endl;
     }
 
-    void Engine::updateLeaderAndGap() {
-        startBarrier.wait();
-        endBarrier.wait();
-    }
-
-    void Engine::notifyCross() {
-        startBarrier.wait();
-        endBarrier.wait();
-    }
-
     void Engine::nextStep() {
         for (auto &flow : flows)
             flow.nextStep(interval);
-        planRoute();
-        handleWaiting();
-        if (laneChange) {
-            initSegments();
-            planLaneChange();
-            updateLeaderAndGap();
-        }
-        notifyCross();
-
-        getAction();
-        updateLocation();
-        updateAction();
-        updateLeaderAndGap();
-
-        if (!rlTrafficLight) {
-            std::vector<Intersection> &intersections = roadnet.getIntersections();
-            for (auto &intersection : intersections)
-                intersection.getTrafficLight().passTime(interval);
+        runStages();
+        if (!observations.empty())
+            observationStep = step + 1;
+        for (Vehicle *vehicle : vehicleRemoveBuffer)
+            delete vehicle;
+        vehicleRemoveBuffer.clear();
+        if (rebalanceInterval > 0 && (step + 1) % rebalanceInterval == 0) {
+            if (threadNum > 1) rebalance();
+            vehicleStore.sortByDrivable(threadDrivablePool);
         }
 
         if (saveReplay) {
@@ -593,20 +945,79 @@ namespace CityFlow {
         step += 1;
     }
 
-    void Engine::initSegments() {
-        startBarrier.wait();
-        endBarrier.wait();
+    void Engine::driveSteps() {
+        std::unique_lock<std::mutex> lock(stepMutex);
+        while (true) {
+            stepCondition.wait(lock, [this] { return stepRequested || stopStepDriver; });
+            if (!stepRequested) break;
+            stepRequested = false;
+            lock.unlock();
+            try {
+                nextStep();
+            } catch (...) {
+                stepError = std::current_exception();
+            }
+            lock.lock();
+            stepInFlight.store(false, std::memory_order_release);
+            stepCondition.notify_all();
+        }
+    }
+
+    void Engine::nextStepAsync() {
+        waitStep();
+        {
+            std::lock_guard<std::mutex> guard(stepMutex);
+            if (!stepDriver.joinable())
+                stepDriver = std::thread(&Engine::driveSteps, this);
+            stepRequested = true;
+            stepInFlight.store(true, std::memory_order_release);
+        }
+        stepCondition.notify_all();
+    }
+
+    void Engine::waitStep() {
+        std::unique_lock<std::mutex> lock(stepMutex);
+        stepCondition.wait(lock, [this] { return !stepInFlight.load(std::memory_order_acquire); });
+        if (stepError) {
+            std::exception_ptr error = stepError;
+            stepError = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    size_t Engine::nextSteps(size_t steps, bool stopWhenEmpty) {
+        size_t done = 0;
+        for (; done < steps; ++done) {
+            if (stopWhenEmpty && isEmpty()) break;
+            nextStep();
+        }
+        return done;
+    }
+
+    size_t Engine::runUntil(double time, bool stopWhenEmpty) {
+        size_t done = 0;
+        for (; getCurrentTime() + eps < time; ++done) {
+            if (stopWhenEmpty && isEmpty()) break;
+            nextStep();
+        }
+        return done;
+    }
+
+    bool Engine::isEmpty() const {
+        if (vehicleRegistry.size() > 0) return false;
+        for (const Flow &flow : flows)
+            if (!flow.isFinished()) return false;
+        return true;
     }
 
     bool Engine::checkPriority(int priority) {
-        return vehiclePool.find(priority) != vehiclePool.end();
+        return vehicleRegistry.contains(priority);
     }
 
     void Engine::pushVehicle(Vehicle *const vehicle, bool pushToDrivable) {
         size_t threadIndex = rnd() % threadNum;
-        vehiclePool.emplace(vehicle->getPriority(), std::make_pair(vehicle, threadIndex));
-        vehicleMap.emplace(vehicle->getId(), vehicle);
-        threadVehiclePool[threadIndex].insert(vehicle);
+        vehicleRegistry.insert(vehicle, threadIndex);
+        vehicleRegistry.bindId(vehicle->getId(), vehicle);
 
         if (pushToDrivable)
             ((Lane *) vehicle->getCurDrivable())->pushWaitingVehicle(vehicle);
@@ -638,7 +1049,7 @@ namespace CityFlow {
         for (const Lane *lane : roadnet.getLanes()) {
             int cnt = 0;
             for (Vehicle *vehicle : lane->getVehicles()) {
-                if (vehicle->getSpeed() < 0.1) { //TODO: better waiting critera
+                if (isWaiting(vehicle)) {
                     cnt += 1;
                 }
             }
@@ -651,14 +1062,108 @@ namespace CityFlow {
         std::map<std::string, std::vector<std::string>> ret;
         for (const Lane *lane : roadnet.getLanes()) {
             std::vector<std::string> vehicles;
+            vehicles.reserve(lane->getVehicleCount());
             for (Vehicle *vehicle : lane->getVehicles()) {
                 vehicles.push_back(vehicle->getId());
             }
-            ret.emplace(lane->getId(), vehicles);
+            ret.emplace(lane->getId(), std::move(vehicles));
         }
         return ret;
     }
 
+    std::vector<std::string> Engine::getLaneIds() const {
+        std::vector<std::string> ret;
+        ret.reserve(roadnet.getLanes().size());
+        for (const Lane *lane : roadnet.getLanes())
+            ret.push_back(lane->getId());
+        return ret;
+    }
+
+    std::vector<std::string> Engine::getRoadIds() const {
+        std::vector<std::string> ret;
+        ret.reserve(roadnet.getRoads().size());
+        for (const Road &road : roadnet.getRoads())
+            ret.push_back(road.getId());
+        return ret;
+    }
+
+    std::vector<std::string> Engine::getIntersectionIds() const {
+        std::vector<std::string> ret;
+        ret.reserve(roadnet.getIntersections().size());
+        for (const Intersection &intersection : roadnet.getIntersections())
+            ret.push_back(intersection.getId());
+        return ret;
+    }
+
+    void Engine::subscribe(const std::string &domain, const std::vector<std::string> &variables) {
+        subscribe(ObservationRegistry::getDomain(domain), variables);
+    }
+
+    void Engine::subscribe(ObservationDomain domain, const std::vector<std::string> &variables) {
+        if (!observations.subscribe(domain, variables)) return;
+        switch (domain) {
+            case ObservationDomain::LANE:
+                if (!laneMetrics) laneMetrics = std::make_shared<LaneMetrics>();
+                laneMetrics->resize(roadnet.getLanes().size());
+                break;
+            case ObservationDomain::ROAD:
+                if (!roadMetrics) roadMetrics = std::make_shared<RoadMetrics>();
+                roadMetrics->resize(roadnet.getRoads().size());
+                break;
+            case ObservationDomain::INTERSECTION:
+                if (!intersectionMetrics) intersectionMetrics = std::make_shared<IntersectionMetrics>();
+                intersectionMetrics->resize(roadnet.getIntersections().size());
+                break;
+            case ObservationDomain::VEHICLE:
+                vehicleStateOffset.resize(roadnet.getDrivables().size());
+                observeVehiclePositions = observations.isSubscribed(domain, "x")
+                        || observations.isSubscribed(domain, "y") || observations.isSubscribed(domain, "heading");
+                break;
+        }
+        observationStep = std::numeric_limits<size_t>::max();
+        buildStages();
+    }
+
+    void Engine::unsubscribe(const std::string &domain) {
+        observations.unsubscribe(ObservationRegistry::getDomain(domain));
+        buildStages();
+    }
+
+    std::shared_ptr<const LaneMetrics> Engine::getLaneMetrics() {
+        if (!observations.isSubscribed(ObservationDomain::LANE))
+            subscribe(ObservationDomain::LANE, {});
+        observe();
+        return laneMetrics;
+    }
+
+    std::shared_ptr<const RoadMetrics> Engine::getRoadMetrics() {
+        if (!observations.isSubscribed(ObservationDomain::ROAD))
+            subscribe(ObservationDomain::ROAD, {});
+        observe();
+        return roadMetrics;
+    }
+
+    std::shared_ptr<const IntersectionMetrics> Engine::getIntersectionMetrics() {
+        if (!observations.isSubscribed(ObservationDomain::INTERSECTION))
+            subscribe(ObservationDomain::INTERSECTION, {});
+        observe();
+        return intersectionMetrics;
+    }
+
+    std::shared_ptr<const VehicleStateColumns> Engine::getVehicleState() {
+        if (!observations.isSubscribed(ObservationDomain::VEHICLE))
+            subscribe(ObservationDomain::VEHICLE, {});
+        observe();
+        return vehicleState;
+    }
+
+    std::string Engine::getVehicleId(VehicleRegistry::Handle handle) const {
+        const Vehicle *vehicle = vehicleRegistry.get(handle);
+        if (!vehicle)
+            throw std::runtime_error("Vehicle handle '" + std::to_string(handle) + "' not found");
+        return vehicle->getId();
+    }
+
     std::map<std::string, double> Engine::getVehicleSpeed() const {
         std::map<std::string, double> ret;
         for (const Vehicle* vehicle : getRunningVehicles()) {
@@ -682,11 +1187,10 @@ namespace CityFlow {
     double Engine::getAverageTravelTime() const {
         double tt = cumulativeTravelTime;
         int n = finishedVehicleCnt;
-        for (auto &vehicle_pair : vehiclePool) {
-            auto &vehicle = vehicle_pair.second.first;
+        vehicleRegistry.forEach([this, &tt, &n](const Vehicle *vehicle) {
             tt += getCurrentTime() - vehicle->getEnterTime();
             n++;
-        }
+        });
         return n == 0 ? 0 : tt / n;
     }
 
@@ -742,10 +1246,9 @@ namespace CityFlow {
     }
     
     void Engine::reset(bool resetRnd) {
-        for (auto &vehiclePair : vehiclePool) delete vehiclePair.second.first;
-        for (auto &pool : threadVehiclePool) pool.clear();
-        vehiclePool.clear();
-        vehicleMap.clear();
+        vehicleRegistry.forEach([](Vehicle *vehicle) { delete vehicle; });
+        vehicleRegistry.clear();
+        vehicleStore.clear();
         roadnet.reset();
 
         finishedVehicleCnt = 0;
@@ -753,24 +1256,182 @@ namespace CityFlow {
 
         for (auto &flow : flows) flow.reset();
         step = 0;
+        observationStep = std::numeric_limits<size_t>::max();
         activeVehicleCount = 0;
         if (resetRnd) {
             rnd.seed(seed);
         }
     }
 
+    // ratio between the busiest thread and the average one
+    static double imbalance(const std::vector<size_t> &loads) {
+        size_t total = 0, busiest = 0;
+        for (size_t load : loads) {
+            total += load;
+            busiest = std::max(busiest, load);
+        }
+        return total == 0 ? 1 : (double) busiest * loads.size() / total;
+    }
+
+    size_t Engine::drivableCost(Drivable *drivable) {
+        return 1 + drivable->getVehicles().size();
+    }
+
+    size_t Engine::intersectionCost(Intersection *intersection) {
+        size_t cost = 1;
+        for (LaneLink *laneLink : intersection->getLaneLinks())
+            cost += 1 + laneLink->getVehicles().size();
+        return cost;
+    }
+
+    size_t Engine::roadCost(Road *road) {
+        size_t cost = 0;
+        for (Lane &lane : road->getLanes()) {
+            cost += drivableCost(&lane);
+            for (LaneLink *laneLink : lane.getLaneLinks())
+                cost += drivableCost(laneLink);
+        }
+        return cost;
+    }
+
+    // Moves whole roads, with the lane links leaving them, from the busiest thread to the idlest
+    // thread whose region borders it, picking the border road that narrows their gap the most,
+    // until the imbalance drops halfway back to 1 from the threshold. Regions only grow along
+    // their border, as partitionRoadNet built them. Nothing moves while the imbalance stays
+    // below the threshold, so partitions do not flap.
+    void Engine::rebalanceRoads() {
+        std::vector<Road> &roads = roadnet.getRoads();
+        std::vector<size_t> costs(roads.size()), loads(threadNum, 0);
+        for (size_t i = 0; i < roads.size(); ++i) {
+            costs[i] = roadCost(&roads[i]);
+            loads[roadThread[i]] += costs[i];
+        }
+        if (imbalance(loads) <= rebalanceThreshold) return;
+
+        double target = 1 + (rebalanceThreshold - 1) / 2;
+        bool moved = false;
+        for (size_t move = 0; move < roads.size() && imbalance(loads) > target; ++move) {
+            size_t busy = std::max_element(loads.begin(), loads.end()) - loads.begin();
+            // roads of the busy thread sharing an intersection with another region
+            std::vector<std::pair<Road *, size_t>> border;
+            size_t idle = busy;
+            for (Road *road : threadRoadPool[busy])
+                for (const Intersection *intersection : {&road->getStartIntersection(), &road->getEndIntersection()})
+                    for (Road *neighbour : intersection->getRoads()) {
+                        size_t thread = roadThread[getRoadIndex(neighbour)];
+                        if (thread == busy) continue;
+                        border.emplace_back(road, thread);
+                        if (idle == busy || loads[thread] < loads[idle]) idle = thread;
+                    }
+            if (idle == busy) break;
+
+            size_t gap = loads[busy] - loads[idle];
+            Road *best = nullptr;
+            for (const auto &candidate : border) {
+                if (candidate.second != idle) continue;
+                size_t c = costs[getRoadIndex(candidate.first)];
+                if (c < gap && (!best || std::abs((long long) gap - 2 * (long long) c) <
+                                         std::abs((long long) gap - 2 * (long long) costs[getRoadIndex(best)])))
+                    best = candidate.first;
+            }
+            if (!best) break;
+
+            std::vector<Road *> &pool = threadRoadPool[busy];
+            pool.erase(std::find(pool.begin(), pool.end(), best));
+            threadRoadPool[idle].push_back(best);
+            roadThread[getRoadIndex(best)] = idle;
+            loads[busy] -= costs[getRoadIndex(best)];
+            loads[idle] += costs[getRoadIndex(best)];
+            moved = true;
+        }
+        if (moved) assignRoadPools();
+    }
+
+    std::vector<size_t> Engine::getThreadVehicleCost() const {
+        std::vector<size_t> loads;
+        for (int i = 0; i < threadNum; ++i)
+            loads.push_back(vehicleRegistry.getThreadVehicles(i).size());
+        return loads;
+    }
+
+    double Engine::getImbalanceFactor() const {
+        std::vector<size_t> drivableLoads, intersectionLoads;
+        for (const auto &drivables : threadDrivablePool) {
+            size_t load = 0;
+            for (Drivable *drivable : drivables) load += drivableCost(drivable);
+            drivableLoads.push_back(load);
+        }
+        for (const auto &intersections : threadIntersectionPool) {
+            size_t load = 0;
+            for (Intersection *intersection : intersections) load += intersectionCost(intersection);
+            intersectionLoads.push_back(load);
+        }
+        return std::max(imbalance(getThreadVehicleCost()),
+                        std::max(imbalance(drivableLoads), imbalance(intersectionLoads)));
+    }
+
+    std::map<std::string, size_t> Engine::getAllocationStats() const {
+        // the pool is shared by every engine in the process
+        SmallObjectPool::Stats stats = SmallObjectPool::getStats();
+        return {{"chunk_allocations", stats.chunkAllocations},
+                {"allocations", stats.allocations},
+                {"deallocations", stats.deallocations},
+                {"large_allocations", stats.largeAllocations},
+                {"depot_transfers", stats.depotTransfers}};
+    }
+
+    void Engine::rebalance() {
+        // intersections and lane links follow the roads, so every region stays in one piece
+        rebalanceRoads();
+
+        // vehicles move together with their shadow
+        std::vector<size_t> loads = getThreadVehicleCost();
+        if (imbalance(loads) <= rebalanceThreshold) return;
+        double target = 1 + (rebalanceThreshold - 1) / 2;
+        while (imbalance(loads) > target) {
+            size_t busy = std::max_element(loads.begin(), loads.end()) - loads.begin();
+            size_t idle = std::min_element(loads.begin(), loads.end()) - loads.begin();
+            size_t count = (loads[busy] - loads[idle]) / 2;
+            if (count == 0) break;
+            std::vector<Vehicle *> moving;
+            for (Vehicle *vehicle : vehicleRegistry.getThreadVehicles(busy)) {
+                if (moving.size() >= count) break;
+                if (!vehicle->hasPartner()) moving.push_back(vehicle);
+            }
+            if (moving.empty()) break;
+            for (Vehicle *vehicle : moving) {
+                vehicleRegistry.moveToThread(vehicle, idle);
+            }
+            loads[busy] -= moving.size();
+            loads[idle] += moving.size();
+        }
+    }
+
     Engine::~Engine() {
+        if (stepDriver.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(stepMutex);
+                stepCondition.wait(lock, [this] { return !stepInFlight.load(std::memory_order_acquire); });
+                stopStepDriver = true;
+            }
+            stepCondition.notify_all();
+            stepDriver.join();
+        }
         logOut.close();
-        finished = true;
-        for (int i = 0; i < (laneChange ? 9 : 6); ++i) {
-            startBarrier.wait();
-            endBarrier.wait();
+        if (!threadPool.empty()) {
+            Barrier::setParticipantId(threadNum);
+            finished = true;
+            stepBarrier->wait();
+            for (auto &thread : threadPool) thread.join();
         }
-        for (auto &thread : threadPool) thread.join();
-        for (auto &vehiclePair : vehiclePool) delete vehiclePair.second.first;
+        vehicleRegistry.forEach([](Vehicle *vehicle) { delete vehicle; });
     }
     
     void Engine::setLogFile(const std::string &jsonFile, const std::string &logFile) {
+        // built only here, engines that write no replay never hold a json copy of the roadnet
+        rapidjson::Document jsonRoot;
+        jsonRoot.SetObject();
+        jsonRoot.AddMember("static", roadnet.convertToJson(jsonRoot.GetAllocator()), jsonRoot.GetAllocator());
         if (!writeJsonToFile(jsonFile, jsonRoot)) {
             std::cerr << "write roadnet log file error" << std::endl;
         }
@@ -780,43 +1441,35 @@ namespace CityFlow {
     std::vector<const Vehicle *> Engine::getRunningVehicles(bool includeWaiting) const {
         std::vector<const Vehicle *> ret;
         ret.reserve(activeVehicleCount);
-        for (const auto &vehiclePair: vehiclePool) {
-            const Vehicle *vehicle = vehiclePair.second.first;
-            if (vehicle->isReal() && (includeWaiting || vehicle->isRunning())) {
-                ret.emplace_back(vehicle);
-            }
+        if (includeWaiting) {
+            vehicleRegistry.forEach([&ret](const Vehicle *vehicle) {
+                if (vehicle->isReal()) ret.emplace_back(vehicle);
+            });
+        } else {
+            for (const Vehicle *vehicle : vehicleRegistry.getRunningVehicles())
+                if (vehicle->isReal()) ret.emplace_back(vehicle);
         }
         return ret;
     }
 
-    void Engine::scheduleLaneChange() {
-        std::sort(laneChangeNotifyBuffer.begin(), laneChangeNotifyBuffer.end(),
-                [](Vehicle *a, Vehicle *b){return a->laneChangeUrgency() > b->laneChangeUrgency();});
-        for (auto v : laneChangeNotifyBuffer){
-            v->updateLaneChangeNeighbor();
-            v->sendSignal();
-            // Lane Change
-            // Insert a shadow vehicle
-            if (v->planLaneChange() && v->canChange() && !v->isChanging()) {
-                std::shared_ptr<LaneChange> lc = v->getLaneChange();
-                if (lc->isGapValid() && v->getCurDrivable()->isLane()) {
-//                    std::cerr << getCurrentTime() <<" " << v->getId() << " dis: "<< v->getDistance() <<" Can Change from "
-//                              << ((Lane*)v->getCurDrivable())->getId()<< " to " << lc->getTarget()->getId() << std::endl;
-                insertShadow(v);
-                }
-            }
+    void Engine::insertShadows() {
+        std::vector<Vehicle *> shadows;
+        for (auto &buffer : threadShadowBuffer) {
+            shadows.insert(shadows.end(), buffer.begin(), buffer.end());
+            buffer.clear();
+        }
+        // priorities come from rnd, so hand them out in an order that does not depend on the threads
+        std::sort(shadows.begin(), shadows.end(), [](Vehicle *a, Vehicle *b) {
+            return a->getPartner()->getPriority() < b->getPartner()->getPriority();
+        });
+        for (Vehicle *shadow : shadows) {
+            int priority;
+            while (checkPriority(priority = rnd()));
+            shadow->setPriority(priority);
+            vehicleRegistry.insert(shadow, vehicleRegistry.getThread(shadow->getPartner()));
+            vehicleRegistry.bindId(shadow->getId(), shadow);
+            activeVehicleCount++;
         }
-        laneChangeNotifyBuffer.clear();
-    }
-
-    void Engine::insertShadow(Vehicle *vehicle) {
-        size_t threadIndex = vehiclePool.at(vehicle->getPriority()).second;
-        Vehicle *shadow = new Vehicle(*vehicle, vehicle->getId() + "_shadow", this);
-        vehicleMap.emplace(shadow->getId(), shadow);
-        vehiclePool.emplace(shadow->getPriority(), std::make_pair(shadow, threadIndex));
-        threadVehiclePool[threadIndex].insert(shadow);
-        vehicle->insertShadow(shadow);
-        activeVehicleCount++;
     }
 
     void Engine::loadFromFile(const char *fileName) {
@@ -825,20 +1478,19 @@ namespace CityFlow {
     }
 
     void Engine::setVehicleSpeed(const std::string &id, double speed) {
-        auto iter = vehicleMap.find(id);
-        if (iter == vehicleMap.end()) {
+        Vehicle *vehicle = vehicleRegistry.findById(id);
+        if (!vehicle) {
             throw std::runtime_error("Vehicle '" + id + "' not found");
         }else {
-            iter->second->setCustomSpeed(speed);
+            vehicle->setCustomSpeed(speed);
         }
     }
 
     std::string Engine::getLeader(const std::string &vehicleId) const {
-        auto iter = vehicleMap.find(vehicleId);
-        if (iter == vehicleMap.end()) {
+        Vehicle *vehicle = vehicleRegistry.findById(vehicleId);
+        if (!vehicle) {
             throw std::runtime_error("Vehicle '" + vehicleId + "' not found");
         }else {
-            Vehicle *vehicle = iter->second;
             if (laneChange) {
                 if (!vehicle->isReal())
                     vehicle = vehicle->getPartner();
@@ -850,9 +1502,8 @@ namespace CityFlow {
     }
 
     bool Engine::setRoute(const std::string &vehicle_id, const std::vector<std::string> &anchor_id) {
-        auto vehicle_itr = vehicleMap.find(vehicle_id);
-        if (vehicle_itr == vehicleMap.end()) return false;
-        Vehicle *vehicle = vehicle_itr->second;
+        Vehicle *vehicle = vehicleRegistry.findById(vehicle_id);
+        if (!vehicle) return false;
 
         std::vector<Road *> anchors;
         for (const auto &id : anchor_id) {
@@ -866,11 +1517,10 @@ namespace CityFlow {
     }
 
     std::map<std::string, std::string> Engine::getVehicleInfo(const std::string &id) const {
-        auto iter = vehicleMap.find(id);
-        if (iter == vehicleMap.end()) {
+        const Vehicle *vehicle = vehicleRegistry.findById(id);
+        if (!vehicle) {
             throw std::runtime_error("Vehicle '" + id + "' not found");
         }else {
-            Vehicle *vehicle = iter->second;
             return vehicle->getInfo();
         }
     }
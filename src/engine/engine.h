@@ -4,30 +4,52 @@
 #include "flow/flow.h"
 #include "roadnet/roadnet.h"
 #include "engine/archive.h"
+#include "engine/observation.h"
+#include "engine/vehicleregistry.h"
+#include "vehicle/vehiclestate.h"
 #include "utility/barrier.h"
+#include "utility/simd.h"
+#include "utility/workstealing.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <set>
 #include <random>
 #include <fstream>
+#include <limits>
+#include <memory>
 
 
 namespace CityFlow {
 
     class Engine {
         friend class Archive;
+        friend class VectorEngine;
     private:
-        static bool vehicleCmp(const std::pair<Vehicle *, double> &a, const std::pair<Vehicle *, double> &b) {
-            return a.second > b.second;
+        // a vehicle moving onto another drivable in this step
+        struct DrivableChange {
+            Drivable *drivable;
+            double distance;
+            Vehicle *vehicle;
+        };
+
+        static bool drivableChangeCmp(const DrivableChange &a, const DrivableChange &b) {
+            if (a.drivable != b.drivable) return std::less<Drivable *>()(a.drivable, b.drivable);
+            if (a.distance != b.distance) return a.distance > b.distance;
+            return a.vehicle->getPriority() < b.vehicle->getPriority();
         }
 
-        std::map<int, std::pair<Vehicle *, int>> vehiclePool;
-        std::map<std::string, Vehicle *> vehicleMap;
-        std::vector<std::set<Vehicle *>> threadVehiclePool;
+        VehicleStateStore vehicleStore; // hot fields of every vehicle, see Vehicle::attach
+        VehicleRegistry vehicleRegistry;
         std::vector<std::vector<Road *>> threadRoadPool;
         std::vector<std::vector<Intersection *>> threadIntersectionPool;
         std::vector<std::vector<Drivable *>> threadDrivablePool;
+        std::vector<std::vector<Vehicle *>> threadVehicleList; // real vehicles of each thread, for stealing
+        std::unique_ptr<WorkStealingQueue> drivableQueue, intersectionQueue, vehicleQueue;
         std::vector<Flow> flows;
         RoadNet roadnet;
         int threadNum;
@@ -35,65 +57,152 @@ namespace CityFlow {
         bool saveReplay;
         bool saveReplayInConfig; // saveReplay option in config json
         bool warnings;
-        std::vector<std::pair<Vehicle *, double>> pushBuffer;
-        std::vector<Vehicle *> laneChangeNotifyBuffer;
-        std::set<Vehicle *> vehicleRemoveBuffer;
-        rapidjson::Document jsonRoot;
+        std::vector<std::vector<DrivableChange>> threadPushBuffer; // sorted by destination, one run per drivable
+        std::vector<std::vector<std::vector<Vehicle *>>> laneChangeNotifyBuffer; // [planning thread][road owner]
+        std::vector<std::vector<Vehicle *>> threadShadowBuffer;
+        std::vector<std::vector<Lane *>> threadWaitingLanes;
+        std::vector<int> roadThread; // owner of each road, indexed like roadnet.getRoads()
+        std::vector<std::vector<Vehicle *>> threadRetireBuffer;
+        std::vector<std::vector<std::pair<Vehicle *, std::string>>> threadLaneChangeFinishBuffer; // new real vehicle, its old id
+        std::set<Vehicle *> vehicleRemoveBuffer; // retired in this step, deleted once the step is over
         std::string stepLog;
 
         size_t step = 0;
         size_t activeVehicleCount = 0;
         int seed;
-        std::mutex lock;
-        Barrier startBarrier, endBarrier;
-        std::vector<std::thread> threadPool;
+        BarrierType barrierType = BarrierType::SPIN;
+        std::unique_ptr<Barrier> stepBarrier;
+        std::vector<std::thread> threadPool; // empty when steps run on the calling thread
         bool finished = false;
         std::string dir;
         std::ofstream logOut;
 
         bool rlTrafficLight;
         bool laneChange;
+        double segmentLength = 0;
+        int rebalanceInterval = 100;
+        double rebalanceThreshold = 1.25;
+        bool scalarCarFollow = false;
         int manuallyPushCnt = 0;
 
+        // positions of the vehicles of one drivable, looked up in a single pass
+        struct PositionBuffer {
+            std::vector<double> distances;
+            std::vector<Point> points, directions;
+
+            void lookup(const Drivable *drivable);
+        };
+        std::vector<PositionBuffer> threadPositionBuffer;
+
+        ObservationRegistry observations;
+        size_t observationStep = std::numeric_limits<size_t>::max(); // step the metrics were taken at
+        // metrics and columns handed out are never written again, new ones are used while they are held
+        std::shared_ptr<LaneMetrics> laneMetrics;
+        std::shared_ptr<RoadMetrics> roadMetrics;
+        std::shared_ptr<IntersectionMetrics> intersectionMetrics;
+        std::shared_ptr<VehicleStateColumns> vehicleState;
+        std::vector<size_t> vehicleStateOffset; // first row of each drivable, its row count before that
+        bool observeVehiclePositions = false; // x, y or heading are subscribed
+
         int finishedVehicleCnt = 0;
         double cumulativeTravelTime = 0;
 
+        // A step is a chain of stages. Every worker runs `work` on its own partition, then
+        // the main thread runs `serial` (if any) once all workers are done. Stages without
+        // serial work are separated by a single barrier instead of a start/end pair.
+        struct Stage {
+            std::function<void(size_t)> work;
+            std::function<void()> serial;
+        };
+        std::vector<Stage> stages;
+
+        // steps started by nextStepAsync run on their own thread, created on first use
+        std::thread stepDriver;
+        std::mutex stepMutex;
+        std::condition_variable stepCondition;
+        bool stepRequested = false;
+        bool stopStepDriver = false;
+        std::atomic<bool> stepInFlight{false};
+        std::exception_ptr stepError;
+
     private:
-        void vehicleControl(Vehicle &vehicle, std::vector<std::pair<Vehicle *, double>> &buffer);
+        // Without workers the engine has a single partition and runs its stages on the thread
+        // calling nextStep, so that a VectorEngine can schedule many engines on one pool.
+        Engine(const std::string &configFile, int threadNum, bool spawnWorkers);
+
+        void vehicleControl(Vehicle &vehicle, size_t threadIndex);
+
+        void buildStages();
+
+        void runStages();
+
+        void driveSteps();
 
         void planRoute();
 
-        void getAction();
+        void retireVehicles();
+
+        void threadController(size_t threadIndex);
+
+        void threadPlanRoute(size_t threadIndex);
+
+        void threadGetAction(size_t threadIndex);
+
+        void threadUpdateAction(size_t threadIndex);
+
+        // the last update of a step also counts the rows of the vehicle state
+        void threadUpdateLeaderAndGap(size_t threadIndex, bool lastUpdate = false);
+
+        void subscribe(ObservationDomain domain, const std::vector<std::string> &variables);
+
+        // takes the metrics of the subscribed domains, unless they are up to date
+        void observe();
+
+        void threadObserve(size_t threadIndex);
 
-        void updateAction();
+        static bool isWaiting(const Vehicle *vehicle) { return vehicle->getSpeed() < 0.1; } //TODO: better waiting critera
 
-        void updateLocation();
+        void updateLaneMetrics(const Lane *lane);
 
-        void updateLeaderAndGap();
+        void updateRoadMetrics(const Road *road);
 
-        void planLaneChange();
+        void updateIntersectionMetrics(Intersection *intersection);
 
+        static size_t countRealVehicles(const Drivable *drivable);
 
-        void threadController(std::set<Vehicle *> &vehicles, 
-                              std::vector<Road *> &roads,
-                              std::vector<Intersection *> &intersections,
-                              std::vector<Drivable *> &drivables);
+        // before the metrics are taken, replaces the ones still held by callers
+        void prepareObservations();
 
-        void threadPlanRoute(const std::vector<Road *> &roads);
+        void layoutVehicleState();
 
-        void threadGetAction(std::set<Vehicle *> &vehicles);
+        void fillVehicleState(const Drivable *drivable, PositionBuffer &buffer);
 
-        void threadUpdateAction(std::set<Vehicle *> &vehicles);
+        void threadUpdateLocation(size_t threadIndex);
 
-        void threadUpdateLeaderAndGap(const std::vector<Drivable *> &drivables);
+        void insertVehicles(Drivable *drivable, std::vector<DrivableChange> &incoming);
 
-        void threadUpdateLocation(const std::vector<Drivable *> &drivables);
+        void threadNotifyCross(size_t threadIndex);
 
-        void threadNotifyCross(const std::vector<Intersection *> &intersections);
+        void threadPlanLaneChange(size_t threadIndex);
 
-        void threadInitSegments(const std::vector<Road *> &roads);
+        void threadScheduleLaneChange(size_t threadIndex);
 
-        void threadPlanLaneChange(const std::set<Vehicle *> &vehicles);
+        void collectThreadVehicles(size_t threadIndex);
+
+        // A vehicle and its shadow touch each other's buffers, so they always run back to back.
+        template <typename Function>
+        void forEachVehicle(size_t threadIndex, Function f) {
+            collectThreadVehicles(threadIndex);
+            vehicleQueue->forEach(threadIndex, threadVehicleList, [&f](Vehicle *vehicle) {
+                Vehicle *shadow = vehicle->hasPartner() ? vehicle->getPartner() : nullptr;
+                f(vehicle);
+                if (shadow) f(shadow);
+            });
+        }
+
+        void notifyCross(Intersection *intersection);
+
+        void threadPassTime(const std::vector<Intersection *> &intersections);
 
         void handleWaiting();
 
@@ -103,13 +212,34 @@ namespace CityFlow {
 
         bool loadRoadNet(const std::string &jsonFile);
 
+        void partitionRoadNet();
+
+        // derives roadThread and the drivable and intersection pools from threadRoadPool
+        void assignRoadPools();
+
         bool loadFlow(const std::string &jsonFilename);
 
         std::vector<const Vehicle *> getRunningVehicles(bool includeWaiting=false) const;
 
-        void scheduleLaneChange();
+        void insertShadows();
+
+        size_t getRoadIndex(const Road *road) const { return road - &roadnet.getRoads()[0]; }
+
+        size_t getIntersectionIndex(const Intersection *intersection) const {
+            return intersection - &roadnet.getIntersections()[0];
+        }
+
+        static size_t drivableCost(Drivable *drivable);
+
+        static size_t intersectionCost(Intersection *intersection);
+
+        static size_t roadCost(Road *road);
+
+        void rebalanceRoads();
 
-        void insertShadow(Vehicle *vehicle);
+        std::vector<size_t> getThreadVehicleCost() const;
+
+        void rebalance();
 
     public:
         std::mt19937 rnd;
@@ -120,20 +250,38 @@ namespace CityFlow {
 
         bool hasLaneChange() const { return laneChange; }
 
-        bool loadConfig(const std::string &configFile);
+        const RoadNet &getRoadNet() const { return roadnet; }
 
-        void notifyCross();
+        bool loadConfig(const std::string &configFile);
 
         void nextStep();
 
+        // Runs up to `steps` steps, stopping early once no vehicle is left and no flow will
+        // add one when stopWhenEmpty is set. Returns the number of steps run.
+        size_t nextSteps(size_t steps, bool stopWhenEmpty = false);
+
+        // runs until the current time reaches `time`, see nextSteps
+        size_t runUntil(double time, bool stopWhenEmpty = false);
+
+        // no vehicle is left and no flow will add one
+        bool isEmpty() const;
+
+        // Starts the next step on another thread and returns at once, after the step in flight
+        // if any. Until pollStep() returns true or waitStep() returns, no other method may be called.
+        void nextStepAsync();
+
+        // whether the step started by nextStepAsync is over, never blocks
+        bool pollStep() const { return !stepInFlight.load(std::memory_order_acquire); }
+
+        // returns once no step is in flight, rethrowing what the step threw
+        void waitStep();
+
         bool checkPriority(int priority);
 
         void pushVehicle(Vehicle *const vehicle, bool pushToDrivable = true);
 
         void setLogFile(const std::string &jsonFile, const std::string &logFile);
 
-        void initSegments();
-
         ~Engine();
 
         // RL related api
@@ -150,6 +298,33 @@ namespace CityFlow {
 
         std::map<std::string, std::vector<std::string>> getLaneVehicles();
 
+        std::vector<std::string> getLaneIds() const;
+
+        std::vector<std::string> getRoadIds() const;
+
+        std::vector<std::string> getIntersectionIds() const;
+
+        // Asks the workers to take these metrics at the end of every step, all variables of
+        // the domain when none are given. Throws std::invalid_argument for unknown names.
+        void subscribe(const std::string &domain, const std::vector<std::string> &variables = {});
+
+        void unsubscribe(const std::string &domain);
+
+        const ObservationRegistry &getSubscriptions() const { return observations; }
+
+        // The getters below subscribe to all variables of an unsubscribed domain. What they
+        // return is never written by later steps while it is held. Positions of vehicles are
+        // left at 0 unless x, y or heading are subscribed.
+        std::shared_ptr<const LaneMetrics> getLaneMetrics();
+
+        std::shared_ptr<const RoadMetrics> getRoadMetrics();
+
+        std::shared_ptr<const IntersectionMetrics> getIntersectionMetrics();
+
+        std::shared_ptr<const VehicleStateColumns> getVehicleState();
+
+        std::string getVehicleId(VehicleRegistry::Handle handle) const;
+
         std::map<std::string, double> getVehicleSpeed() const;
 
         std::map<std::string, double> getVehicleDistance() const;
@@ -160,6 +335,10 @@ namespace CityFlow {
 
         double getAverageTravelTime() const;
 
+        double getImbalanceFactor() const;
+
+        std::map<std::string, size_t> getAllocationStats() const;
+
         void setTrafficLightPhase(const std::string &id, int phaseIndex);
 
         void setReplayLogFile(const std::string &logFile);
@@ -169,6 +348,16 @@ namespace CityFlow {
         void setVehicleSpeed(const std::string &id, double speed);
 
         void setRandomSeed(int seed) { rnd.seed(seed); }
+
+        // compute car following per vehicle instead of in batches, to validate the vector kernels
+        void setScalarCarFollow(bool scalar) { scalarCarFollow = scalar; }
+
+        bool isScalarCarFollow() const { return scalarCarFollow; }
+
+        SimdLevel getCarFollowLevel() const { return scalarCarFollow ? SimdLevel::GENERIC : getSimdLevel(); }
+
+        // instruction set of the vector kernels in use
+        std::string getKernelVariant() const { return getSimdLevelName(getCarFollowLevel()); }
         
         void reset(bool resetRnd = false);
 
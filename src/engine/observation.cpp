@@ -0,0 +1,102 @@
+#include "engine/observation.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace CityFlow {
+
+    void LaneMetrics::resize(size_t size) {
+        vehicleCount.resize(size);
+        waitingVehicleCount.resize(size);
+        meanSpeed.resize(size);
+        occupancy.resize(size);
+    }
+
+    void RoadMetrics::resize(size_t size) {
+        vehicleCount.resize(size);
+        waitingVehicleCount.resize(size);
+        meanSpeed.resize(size);
+    }
+
+    void IntersectionMetrics::resize(size_t size) {
+        phase.resize(size);
+        waitingVehicleCount.resize(size);
+    }
+
+    void VehicleStateColumns::resize(size_t size) {
+        handle.resize(size);
+        speed.resize(size);
+        distance.resize(size);
+        drivableIndex.resize(size);
+        roadIndex.resize(size);
+        x.resize(size);
+        y.resize(size);
+        heading.resize(size);
+        laneChangeDirection.resize(size);
+        enterTime.resize(size);
+    }
+
+    bool ObservationRegistry::subscribe(ObservationDomain domain, const std::vector<std::string> &names) {
+        const std::vector<std::string> &known = getDomainVariables(domain);
+        for (const std::string &name : names) {
+            if (std::find(known.begin(), known.end(), name) == known.end())
+                throw std::invalid_argument(std::string("unknown ") + getDomainName(domain) + " variable " + name);
+        }
+        std::vector<std::string> &subscribed = variables[static_cast<size_t>(domain)];
+        bool added = false;
+        for (const std::string &name : names.empty() ? known : names) {
+            if (std::find(subscribed.begin(), subscribed.end(), name) == subscribed.end()) {
+                subscribed.push_back(name);
+                added = true;
+            }
+        }
+        return added;
+    }
+
+    bool ObservationRegistry::subscribe(const std::string &domain, const std::vector<std::string> &names) {
+        return subscribe(getDomain(domain), names);
+    }
+
+    bool ObservationRegistry::isSubscribed(ObservationDomain domain, const std::string &variable) const {
+        const std::vector<std::string> &subscribed = getVariables(domain);
+        return std::find(subscribed.begin(), subscribed.end(), variable) != subscribed.end();
+    }
+
+    bool ObservationRegistry::empty() const {
+        for (const auto &subscribed : variables)
+            if (!subscribed.empty()) return false;
+        return true;
+    }
+
+    ObservationDomain ObservationRegistry::getDomain(const std::string &name) {
+        for (size_t i = 0; i < DOMAIN_NUM; ++i) {
+            ObservationDomain domain = static_cast<ObservationDomain>(i);
+            if (name == getDomainName(domain)) return domain;
+        }
+        throw std::invalid_argument("unknown observation domain " + name);
+    }
+
+    const char *ObservationRegistry::getDomainName(ObservationDomain domain) {
+        switch (domain) {
+            case ObservationDomain::LANE:
+                return "lane";
+            case ObservationDomain::ROAD:
+                return "road";
+            case ObservationDomain::INTERSECTION:
+                return "intersection";
+            default:
+                return "vehicle";
+        }
+    }
+
+    const std::vector<std::string> &ObservationRegistry::getDomainVariables(ObservationDomain domain) {
+        static const std::vector<std::string> domainVariables[DOMAIN_NUM] = {
+                {"vehicle_count", "waiting_vehicle_count", "mean_speed", "occupancy"},
+                {"vehicle_count", "waiting_vehicle_count", "mean_speed"},
+                {"phase", "waiting_vehicle_count"},
+                {"handle", "speed", "distance", "drivable_index", "road_index", "x", "y", "heading",
+                 "lane_change_direction", "enter_time"}
+        };
+        return domainVariables[static_cast<size_t>(domain)];
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef CITYFLOW_OBSERVATION_H
+#define CITYFLOW_OBSERVATION_H
+
+#include "engine/vehicleregistry.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace CityFlow {
+
+    // Metrics of every lane, indexed like Engine::getLaneIds() and Lane::getRoadnetIndex().
+    struct LaneMetrics {
+        std::vector<int> vehicleCount;
+        std::vector<int> waitingVehicleCount;
+        std::vector<double> meanSpeed;
+        std::vector<double> occupancy; // total length of the vehicles over the lane length
+
+        void resize(size_t size);
+    };
+
+    // Metrics of every road over all of its lanes, indexed like Engine::getRoadIds().
+    struct RoadMetrics {
+        std::vector<int> vehicleCount;
+        std::vector<int> waitingVehicleCount;
+        std::vector<double> meanSpeed;
+
+        void resize(size_t size);
+    };
+
+    // Metrics of every intersection, indexed like Engine::getIntersectionIds().
+    struct IntersectionMetrics {
+        std::vector<int> phase;
+        std::vector<int> waitingVehicleCount; // on the lanes entering the intersection
+
+        void resize(size_t size);
+    };
+
+    // State of the running vehicles, one array per field. Rows follow RoadNet::getDrivables(),
+    // and the head of the traffic comes first on each drivable.
+    struct VehicleStateColumns {
+        std::vector<VehicleRegistry::Handle> handle; // see Engine::getVehicleId
+        std::vector<double> speed;
+        std::vector<double> distance;
+        std::vector<int> drivableIndex;              // position in RoadNet::getDrivables()
+        std::vector<int> roadIndex;                  // position in RoadNet::getRoads(), -1 on a lane link
+        std::vector<double> x;
+        std::vector<double> y;
+        std::vector<double> heading;
+        std::vector<int> laneChangeDirection;        // of the last lane change, as in the replay
+        std::vector<double> enterTime;
+
+        size_t size() const { return handle.size(); }
+
+        void resize(size_t size);
+    };
+
+    // metrics still held by a caller keep their values, the next writes go to new ones
+    template <typename T>
+    void replaceIfHeld(std::shared_ptr<T> &metrics) {
+        if (metrics.use_count() == 1) return;
+        size_t size = metrics->waitingVehicleCount.size();
+        metrics = std::make_shared<T>();
+        metrics->resize(size);
+    }
+
+    enum class ObservationDomain { LANE = 0, ROAD, INTERSECTION, VEHICLE };
+
+    // Variables subscribed to in each domain, named like the keys of the python results.
+    // Engines fill the metrics of subscribed domains in the last stage of every step.
+    class ObservationRegistry {
+    public:
+        static const size_t DOMAIN_NUM = 4;
+
+        // Adds the variables, or all variables of the domain when none are given. Returns
+        // whether anything was added, throws std::invalid_argument for unknown names.
+        bool subscribe(ObservationDomain domain, const std::vector<std::string> &variables = {});
+
+        bool subscribe(const std::string &domain, const std::vector<std::string> &variables);
+
+        void unsubscribe(ObservationDomain domain) { variables[static_cast<size_t>(domain)].clear(); }
+
+        bool isSubscribed(ObservationDomain domain) const { return !getVariables(domain).empty(); }
+
+        bool isSubscribed(ObservationDomain domain, const std::string &variable) const;
+
+        bool empty() const;
+
+        // in the order they were subscribed
+        const std::vector<std::string> &getVariables(ObservationDomain domain) const {
+            return variables[static_cast<size_t>(domain)];
+        }
+
+        static ObservationDomain getDomain(const std::string &name);
+
+        static const char *getDomainName(ObservationDomain domain);
+
+        static const std::vector<std::string> &getDomainVariables(ObservationDomain domain);
+
+    private:
+        std::vector<std::string> variables[DOMAIN_NUM];
+    };
+}
+
+#endif //CITYFLOW_OBSERVATION_H
@@ -0,0 +1,138 @@
+#include "engine/vectorengine.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace CityFlow {
+
+    // copies the metrics of one environment into its row of the batch
+    template <typename T>
+    static void copyRow(const std::vector<T> &metrics, std::vector<T> &batch, size_t index) {
+        std::copy(metrics.begin(), metrics.end(), batch.begin() + index * metrics.size());
+    }
+
+    VectorEngine::VectorEngine(const std::string &configFile, size_t envNum, int threadNum, size_t episodeSteps)
+        : episodeSteps(episodeSteps), dones(envNum, 0), threadNum(threadNum) {
+        if (envNum == 0) throw std::invalid_argument("envNum should be positive");
+        if (threadNum <= 0) throw std::invalid_argument("threadNum should be positive");
+        for (size_t i = 0; i < envNum; ++i) {
+            envs.emplace_back(new Engine(configFile, 1, false));
+            Engine &env = *envs.back();
+            env.seed += static_cast<int>(i);
+            env.rnd.seed(env.seed);
+        }
+
+        stepBarrier = Barrier::create(envs.front()->barrierType, threadNum + 1);
+        for (int i = 0; i < threadNum; i++) {
+            threadPool.emplace_back(&VectorEngine::threadController, this, i);
+        }
+    }
+
+    VectorEngine::~VectorEngine() {
+        Barrier::setParticipantId(threadNum);
+        finished = true;
+        stepBarrier->wait();
+        for (auto &thread : threadPool) thread.join();
+    }
+
+    void VectorEngine::threadController(size_t threadIndex) {
+        Barrier::setParticipantId(threadIndex);
+        while (true) {
+            stepBarrier->wait();
+            if (finished) break;
+            for (size_t i = nextEnv++; i < envs.size(); i = nextEnv++) {
+                try {
+                    stepEnv(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(errorMutex);
+                    if (!stepError) stepError = std::current_exception();
+                }
+            }
+            stepBarrier->wait();
+        }
+    }
+
+    void VectorEngine::nextStep() {
+        prepareMetrics();
+        nextEnv = 0;
+        Barrier::setParticipantId(threadNum);
+        stepBarrier->wait();
+        stepBarrier->wait();
+        if (stepError) {
+            std::exception_ptr error = stepError;
+            stepError = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+
+    void VectorEngine::stepEnv(size_t index) {
+        Engine &env = *envs[index];
+        env.nextStep();
+        bool done = env.isEmpty() || (episodeSteps != 0 && env.step >= episodeSteps);
+        dones[index] = done;
+        collectMetrics(index);
+        if (done) env.reset();
+    }
+
+    void VectorEngine::collectMetrics(size_t index) {
+        Engine &env = *envs[index];
+        if (observations.isSubscribed(ObservationDomain::LANE)) {
+            const LaneMetrics &metrics = *env.getLaneMetrics();
+            copyRow(metrics.vehicleCount, laneMetrics->vehicleCount, index);
+            copyRow(metrics.waitingVehicleCount, laneMetrics->waitingVehicleCount, index);
+            copyRow(metrics.meanSpeed, laneMetrics->meanSpeed, index);
+            copyRow(metrics.occupancy, laneMetrics->occupancy, index);
+        }
+        if (observations.isSubscribed(ObservationDomain::ROAD)) {
+            const RoadMetrics &metrics = *env.getRoadMetrics();
+            copyRow(metrics.vehicleCount, roadMetrics->vehicleCount, index);
+            copyRow(metrics.waitingVehicleCount, roadMetrics->waitingVehicleCount, index);
+            copyRow(metrics.meanSpeed, roadMetrics->meanSpeed, index);
+        }
+        if (observations.isSubscribed(ObservationDomain::INTERSECTION)) {
+            const IntersectionMetrics &metrics = *env.getIntersectionMetrics();
+            copyRow(metrics.phase, intersectionMetrics->phase, index);
+            copyRow(metrics.waitingVehicleCount, intersectionMetrics->waitingVehicleCount, index);
+        }
+    }
+
+    void VectorEngine::prepareMetrics() {
+        if (observations.isSubscribed(ObservationDomain::LANE)) replaceIfHeld(laneMetrics);
+        if (observations.isSubscribed(ObservationDomain::ROAD)) replaceIfHeld(roadMetrics);
+        if (observations.isSubscribed(ObservationDomain::INTERSECTION)) replaceIfHeld(intersectionMetrics);
+    }
+
+    void VectorEngine::reset() {
+        for (auto &env : envs) env->reset(true);
+        std::fill(dones.begin(), dones.end(), 0);
+        prepareMetrics();
+        for (size_t i = 0; i < envs.size(); ++i) collectMetrics(i);
+    }
+
+    void VectorEngine::subscribe(const std::string &domain, const std::vector<std::string> &variables) {
+        observations.subscribe(domain, variables);
+        for (auto &env : envs) env->subscribe(domain, variables);
+        size_t envNum = envs.size();
+        switch (ObservationRegistry::getDomain(domain)) {
+            case ObservationDomain::LANE:
+                replaceIfHeld(laneMetrics);
+                laneMetrics->resize(envNum * getLaneIds().size());
+                break;
+            case ObservationDomain::ROAD:
+                replaceIfHeld(roadMetrics);
+                roadMetrics->resize(envNum * getRoadIds().size());
+                break;
+            case ObservationDomain::INTERSECTION:
+                replaceIfHeld(intersectionMetrics);
+                intersectionMetrics->resize(envNum * getIntersectionIds().size());
+                break;
+            default:
+                break;
+        }
+    }
+
+    void VectorEngine::unsubscribe(const std::string &domain) {
+        observations.unsubscribe(ObservationRegistry::getDomain(domain));
+        for (auto &env : envs) env->unsubscribe(domain);
+    }
+}
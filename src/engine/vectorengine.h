@@ -0,0 +1,95 @@
+#ifndef CITYFLOW_VECTORENGINE_H
+#define CITYFLOW_VECTORENGINE_H
+
+#include "engine/engine.h"
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CityFlow {
+
+    // Independent simulations of the same config, stepped together on one pool of workers.
+    // Every environment runs on a single thread, the workers take whole environments in
+    // turn, so environments of different cost still keep the pool busy.
+    class VectorEngine {
+    public:
+        // Environment i uses the seed of the config plus i. An environment is done once it is
+        // empty, or after episodeSteps steps unless that is 0.
+        VectorEngine(const std::string &configFile, size_t envNum, int threadNum, size_t episodeSteps = 0);
+
+        ~VectorEngine();
+
+        size_t getEnvNum() const { return envs.size(); }
+
+        // for actions and per-environment queries, only between two steps
+        Engine &getEnv(size_t index) { return *envs.at(index); }
+
+        // Steps every environment once, then takes the subscribed metrics of all of them. Done
+        // environments are reset right after, their metrics are the last ones of the episode.
+        // Rethrows the first exception an environment threw, once all of them are done.
+        void nextStep();
+
+        // resets every environment to the beginning of its random stream, then takes the
+        // subscribed metrics of all of them
+        void reset();
+
+        // whether each environment ended its episode in the last step, 1 or 0
+        const std::vector<unsigned char> &getDones() const { return dones; }
+
+        std::vector<std::string> getLaneIds() const { return envs.front()->getLaneIds(); }
+
+        std::vector<std::string> getRoadIds() const { return envs.front()->getRoadIds(); }
+
+        std::vector<std::string> getIntersectionIds() const { return envs.front()->getIntersectionIds(); }
+
+        // Subscribes every environment, see Engine::subscribe. The vehicle domain is per
+        // environment, ask getEnv(i) for it.
+        void subscribe(const std::string &domain, const std::vector<std::string> &variables = {});
+
+        void unsubscribe(const std::string &domain);
+
+        const ObservationRegistry &getSubscriptions() const { return observations; }
+
+        // Metrics of all environments after the last step or reset, row i of each
+        // [envNum x count] array belongs to environment i. Left unchanged while the domain is
+        // unsubscribed. Metrics still held are never overwritten, see Engine::getLaneMetrics.
+        std::shared_ptr<const LaneMetrics> getLaneMetrics() const { return laneMetrics; }
+
+        std::shared_ptr<const RoadMetrics> getRoadMetrics() const { return roadMetrics; }
+
+        std::shared_ptr<const IntersectionMetrics> getIntersectionMetrics() const { return intersectionMetrics; }
+
+    private:
+        std::vector<std::unique_ptr<Engine>> envs;
+        size_t episodeSteps;
+        std::vector<unsigned char> dones;
+
+        ObservationRegistry observations;
+        std::shared_ptr<LaneMetrics> laneMetrics = std::make_shared<LaneMetrics>();
+        std::shared_ptr<RoadMetrics> roadMetrics = std::make_shared<RoadMetrics>();
+        std::shared_ptr<IntersectionMetrics> intersectionMetrics = std::make_shared<IntersectionMetrics>();
+
+        int threadNum;
+        std::unique_ptr<Barrier> stepBarrier;
+        std::vector<std::thread> threadPool;
+        std::atomic<size_t> nextEnv{0};
+        bool finished = false;
+        std::mutex errorMutex;
+        std::exception_ptr stepError; // first exception of the step, thrown by nextStep
+
+        void threadController(size_t threadIndex);
+
+        void stepEnv(size_t index);
+
+        void collectMetrics(size_t index);
+
+        // called before the metrics of a step are collected
+        void prepareMetrics();
+    };
+}
+
+#endif //CITYFLOW_VECTORENGINE_H
@@ -0,0 +1,150 @@
+#include "engine/vehicleregistry.h"
+#include "vehicle/vehicle.h"
+
+#include <cassert>
+#include <utility>
+
+namespace CityFlow {
+
+    static inline VehicleRegistry::Handle makeHandle(uint32_t slot, uint32_t generation) {
+        return (VehicleRegistry::Handle) slot | ((VehicleRegistry::Handle) generation << 32);
+    }
+
+    uint32_t VehicleRegistry::DenseList::push(Vehicle *vehicle, uint32_t slot) {
+        vehicles.push_back(vehicle);
+        slots.push_back(slot);
+        return (uint32_t) vehicles.size() - 1;
+    }
+
+    uint32_t VehicleRegistry::DenseList::remove(uint32_t position) {
+        uint32_t last = (uint32_t) vehicles.size() - 1;
+        uint32_t moved = NONE;
+        if (position != last) {
+            vehicles[position] = vehicles[last];
+            slots[position] = slots[last];
+            moved = slots[position];
+        }
+        vehicles.pop_back();
+        slots.pop_back();
+        return moved;
+    }
+
+    VehicleRegistry::VehicleRegistry(std::size_t threadNum) : threads(threadNum) {}
+
+    VehicleRegistry::Handle VehicleRegistry::insert(Vehicle *vehicle, std::size_t threadIndex) {
+        assert(!contains(vehicle->getPriority()));
+        uint32_t index;
+        if (freeSlots.empty()) {
+            index = (uint32_t) slots.size();
+            slots.emplace_back();
+        } else {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        Slot &slot = slots[index];
+        slot.vehicle = vehicle;
+        slot.thread = (uint32_t) threadIndex;
+        slot.threadPosition = threads[threadIndex].push(vehicle, index);
+        slotByPriority.emplace(vehicle->getPriority(), index);
+        if (vehicle->isRunning())
+            slot.runningPosition = running.push(vehicle, index);
+        return makeHandle(index, slot.generation);
+    }
+
+    void VehicleRegistry::erase(Vehicle *vehicle) {
+        uint32_t index = slotOf(vehicle);
+        Slot &slot = slots[index];
+        removeFromThread(slot);
+        if (slot.runningPosition != NONE) {
+            uint32_t moved = running.remove(slot.runningPosition);
+            if (moved != NONE) slots[moved].runningPosition = slot.runningPosition;
+        }
+        slotByPriority.erase(vehicle->getPriority());
+        slot.vehicle = nullptr;
+        slot.runningPosition = NONE;
+        slot.generation++;
+        freeSlots.push_back(index);
+    }
+
+    void VehicleRegistry::clear() {
+        // the slots are kept, so their generations outlive the vehicles, and they are handed
+        // out again from the first one
+        freeSlots.clear();
+        for (uint32_t index = (uint32_t) slots.size(); index-- > 0;) {
+            Slot &slot = slots[index];
+            if (slot.vehicle) slot.generation++;
+            slot.vehicle = nullptr;
+            slot.runningPosition = NONE;
+            freeSlots.push_back(index);
+        }
+        for (auto &thread : threads) thread.clear();
+        running.clear();
+        slotByPriority.clear();
+        vehicleById.clear();
+    }
+
+    VehicleRegistry::Handle VehicleRegistry::getHandle(const Vehicle *vehicle) const {
+        auto iter = slotByPriority.find(vehicle->getPriority());
+        if (iter == slotByPriority.end() || slots[iter->second].vehicle != vehicle) return INVALID_HANDLE;
+        return makeHandle(iter->second, slots[iter->second].generation);
+    }
+
+    Vehicle *VehicleRegistry::get(Handle handle) const {
+        uint32_t index = (uint32_t) (handle & 0xffffffffu);
+        if (index >= slots.size() || slots[index].generation != (uint32_t) (handle >> 32)) return nullptr;
+        return slots[index].vehicle;
+    }
+
+    std::size_t VehicleRegistry::getThread(const Vehicle *vehicle) const {
+        return slots[slotOf(vehicle)].thread;
+    }
+
+    void VehicleRegistry::moveToThread(Vehicle *vehicle, std::size_t threadIndex) {
+        uint32_t index = slotOf(vehicle);
+        Slot &slot = slots[index];
+        removeFromThread(slot);
+        slot.thread = (uint32_t) threadIndex;
+        slot.threadPosition = threads[threadIndex].push(vehicle, index);
+    }
+
+    void VehicleRegistry::setRunning(Vehicle *vehicle) {
+        uint32_t index = slotOf(vehicle);
+        Slot &slot = slots[index];
+        if (slot.runningPosition == NONE)
+            slot.runningPosition = running.push(vehicle, index);
+    }
+
+    void VehicleRegistry::swapSlots(Vehicle *vehicle, Vehicle *successor) {
+        uint32_t first = slotOf(vehicle), second = slotOf(successor);
+        Slot &a = slots[first], &b = slots[second];
+        std::swap(a.vehicle, b.vehicle);
+        std::swap(a.thread, b.thread);
+        std::swap(a.threadPosition, b.threadPosition);
+        std::swap(a.runningPosition, b.runningPosition);
+        relink(first);
+        relink(second);
+    }
+
+    Vehicle *VehicleRegistry::findById(const std::string &id) const {
+        auto iter = vehicleById.find(id);
+        return iter == vehicleById.end() ? nullptr : iter->second;
+    }
+
+    uint32_t VehicleRegistry::slotOf(const Vehicle *vehicle) const {
+        auto iter = slotByPriority.find(vehicle->getPriority());
+        assert(iter != slotByPriority.end() && slots[iter->second].vehicle == vehicle);
+        return iter->second;
+    }
+
+    void VehicleRegistry::relink(uint32_t index) {
+        const Slot &slot = slots[index];
+        threads[slot.thread].slots[slot.threadPosition] = index;
+        if (slot.runningPosition != NONE) running.slots[slot.runningPosition] = index;
+        slotByPriority[slot.vehicle->getPriority()] = index;
+    }
+
+    void VehicleRegistry::removeFromThread(Slot &slot) {
+        uint32_t moved = threads[slot.thread].remove(slot.threadPosition);
+        if (moved != NONE) slots[moved].threadPosition = slot.threadPosition;
+    }
+}
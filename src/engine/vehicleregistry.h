@@ -0,0 +1,111 @@
+#ifndef CITYFLOW_VEHICLEREGISTRY_H
+#define CITYFLOW_VEHICLEREGISTRY_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace CityFlow {
+    class Vehicle;
+
+    // Slot map of every vehicle owned by an engine. A vehicle keeps its slot until it is
+    // erased, a handle packs the slot with a generation so stale handles can be detected.
+    // Each thread's vehicles and the running vehicles are also kept in dense arrays that
+    // are patched by swap-remove, so all updates are O(1).
+    class VehicleRegistry {
+    public:
+        using Handle = uint64_t;
+
+        static const Handle INVALID_HANDLE = ~Handle(0);
+
+        explicit VehicleRegistry(std::size_t threadNum = 1);
+
+        Handle insert(Vehicle *vehicle, std::size_t threadIndex);
+
+        void erase(Vehicle *vehicle);
+
+        // frees every slot, handles of the vehicles before are stale afterwards
+        void clear();
+
+        bool contains(int priority) const { return slotByPriority.count(priority) > 0; }
+
+        Handle getHandle(const Vehicle *vehicle) const;
+
+        Vehicle *get(Handle handle) const;
+
+        std::size_t getThread(const Vehicle *vehicle) const;
+
+        void moveToThread(Vehicle *vehicle, std::size_t threadIndex);
+
+        // vehicles enter the running index once, and leave it when they are erased
+        void setRunning(Vehicle *vehicle);
+
+        // successor takes the slot, and so the handle, of vehicle and vehicle the one of
+        // successor, as a shadow does when it finishes a lane change
+        void swapSlots(Vehicle *vehicle, Vehicle *successor);
+
+        const std::vector<Vehicle *> &getThreadVehicles(std::size_t threadIndex) const {
+            return threads[threadIndex].vehicles;
+        }
+
+        const std::vector<Vehicle *> &getRunningVehicles() const { return running.vehicles; }
+
+        std::size_t size() const { return slotByPriority.size(); }
+
+        // visits every vehicle in slot order, which does not depend on the number of threads
+        template <typename Function>
+        void forEach(Function f) const {
+            for (const Slot &slot : slots)
+                if (slot.vehicle) f(slot.vehicle);
+        }
+
+        // string IDs are bound separately, a finished lane change hands its ID to the shadow
+        // together with the slot, see swapSlots
+        void bindId(const std::string &id, Vehicle *vehicle) { vehicleById[id] = vehicle; }
+
+        void unbindId(const std::string &id) { vehicleById.erase(id); }
+
+        Vehicle *findById(const std::string &id) const;
+
+    private:
+        static const uint32_t NONE = ~uint32_t(0);
+
+        struct Slot {
+            Vehicle *vehicle = nullptr;
+            uint32_t generation = 0;
+            uint32_t thread = 0;
+            uint32_t threadPosition = 0;
+            uint32_t runningPosition = NONE;
+        };
+
+        // dense array of vehicles, with the slot of each entry for swap-remove
+        struct DenseList {
+            std::vector<Vehicle *> vehicles;
+            std::vector<uint32_t> slots;
+
+            uint32_t push(Vehicle *vehicle, uint32_t slot);
+
+            // returns the slot of the entry moved into the hole, or NONE
+            uint32_t remove(uint32_t position);
+
+            void clear() { vehicles.clear(); slots.clear(); }
+        };
+
+        uint32_t slotOf(const Vehicle *vehicle) const;
+
+        void removeFromThread(Slot &slot);
+
+        // points the dense lists and the priority index at slot index again
+        void relink(uint32_t index);
+
+        std::vector<Slot> slots;
+        std::vector<uint32_t> freeSlots;
+        std::vector<DenseList> threads;
+        DenseList running;
+        std::unordered_map<int, uint32_t> slotByPriority;
+        std::unordered_map<std::string, Vehicle *> vehicleById;
+    };
+}
+
+#endif //CITYFLOW_VEHICLEREGISTRY_H
@@ -21,10 +21,6 @@ namespace CityFlow {
         currentTime += timeInterval;
     }
 
-    std::string Flow::getId() const {
-        return id;
-    }
-
     void Flow::reset() {
         nowTime = interval;
         currentTime = 0;
@@ -37,10 +37,13 @@ namespace CityFlow {
 
         void nextStep(double timeInterval);
 
-        std::string getId() const;
+        const std::string &getId() const { return id; }
 
         bool isValid() const { return this->valid; }
 
+        // no vehicle will be added any more
+        bool isFinished() const { return !valid || (endTime != -1 && currentTime > endTime); }
+
         void setValid(const bool valid) {
             if (this->valid && !valid)
                 std::cerr << "[warning] Invalid route '" << id << "'. Omitted by default." << std::endl;
@@ -1,5 +1,6 @@
 #include "roadnet/roadnet.h"
 #include "utility/config.h"
+#include "utility/simd.h"
 #include "vehicle/vehicle.h"
 
 #include "rapidjson/document.h"
@@ -7,27 +8,13 @@
 
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <mutex>
 
 using std::map;
 using std::string;
 
 namespace CityFlow {
-    static double getLengthOfPoints(const std::vector<Point> &points);
-
-    static Point getPointByDistance(const std::vector<Point> &points, double dis) {
-        dis = min2double(max2double(dis, 0), getLengthOfPoints(points));
-        if (dis <= 0.0)
-            return points[0];
-        for (size_t i = 1; i < points.size(); i++) {
-            double len = (points[i - 1] - points[i]).len();
-            if (dis > len)
-                dis -= len;
-            else
-                return points[i - 1] + (points[i] - points[i - 1]) * (dis / len);
-        }
-        return points.back();
-    }
-
     static double getLengthOfPoints(const std::vector<Point> &points) {
         double length = 0.0;
         for (size_t i = 0; i + 1 < points.size(); i++)
@@ -35,16 +22,107 @@ namespace CityFlow {
         return length;
     }
 
+    // sources of the roadnets loaded so far, by file, dropped with the last roadnet using them
+    namespace {
+        struct CachedSource {
+            size_t hash;
+            std::weak_ptr<const RoadNetSource> source;
+        };
+
+        std::mutex sourceCacheMutex;
+        std::map<std::string, CachedSource> sourceCache;
+
+        std::shared_ptr<const RoadNetSource> findSource(const std::string &fileName, size_t hash,
+                                                        const std::string &text) {
+            std::lock_guard<std::mutex> guard(sourceCacheMutex);
+            auto iter = sourceCache.find(fileName);
+            if (iter == sourceCache.end() || iter->second.hash != hash) return nullptr;
+            // the hash only rules files out, a file edited in place may still collide
+            std::shared_ptr<const RoadNetSource> source = iter->second.source.lock();
+            if (!source || source->text != text) return nullptr;
+            return source;
+        }
+
+        void addSource(const std::string &fileName, size_t hash, std::shared_ptr<const RoadNetSource> source) {
+            std::lock_guard<std::mutex> guard(sourceCacheMutex);
+            sourceCache[fileName] = CachedSource{hash, source};
+        }
+    }
+
     Point RoadNet::getPoint(const Point &p1, const Point &p2, double a) {
         return Point((p2.x - p1.x) * a + p1.x, (p2.y - p1.y) * a + p1.y);
     }
 
-    bool RoadNet::loadFromJson(std::string jsonFileName) {
-        rapidjson::Document document;
-        if (!readJsonFromFile(jsonFileName, document)) {
+    // the points of the lane link if given, else a bezier curve between the lanes
+    std::vector<Point> RoadNet::getLaneLinkPoints(const rapidjson::Value &laneLinkValue, const Lane *startLane,
+                                                  const Lane *endLane) {
+        std::vector<Point> points;
+        auto iter = laneLinkValue.FindMember("points");
+        if (iter != laneLinkValue.MemberEnd() && !iter->value.IsArray())
+            throw JsonTypeError("points in laneLink", "array");
+        if (iter != laneLinkValue.MemberEnd() && !iter->value.Empty())
+            for (const auto &pValue : iter->value.GetArray()) {
+                points.emplace_back(getJsonMember<double>("x", pValue),
+                                    getJsonMember<double>("y", pValue));
+            }
+        else {
+            Point start = Point(startLane->getPointByDistance(
+                    startLane->getLength() - startLane->getEndIntersection()->width));
+            Point end = Point(
+                    endLane->getPointByDistance(0.0 + endLane->getStartIntersection()->width));
+            double len = (Point(end.x - start.x, end.y - start.y)).len();
+            Point startDirection = startLane->getDirectionByDistance(
+                    startLane->getLength() - startLane->getEndIntersection()->width);
+            Point endDirection = endLane->getDirectionByDistance(
+                    0.0 + endLane->getStartIntersection()->width);
+            double minGap = 5;
+            double gap1X = startDirection.x * len * 0.5;
+            double gap1Y = startDirection.y * len * 0.5;
+            double gap2X = -endDirection.x * len * 0.5;
+            double gap2Y = -endDirection.y * len * 0.5;
+            if (gap1X * gap1X + gap1Y * gap1Y < 25 && startLane->getEndIntersection()->width >= 5) {
+                gap1X = minGap * startDirection.x;
+                gap1Y = minGap * startDirection.y;
+            }
+            if (gap2X * gap2X + gap2Y * gap2Y < 25 && endLane->getStartIntersection()->width >= 5) {
+                gap2X = minGap * endDirection.x;
+                gap2Y = minGap * endDirection.y;
+            }
+            Point mid1 = Point(start.x + gap1X,start.y + gap1Y);
+            Point mid2 = Point(end.x + gap2X,end.y + gap2Y);
+            int numPoints = 10;
+            for (int i = 0; i <= numPoints; i++) {
+                Point p1 = getPoint(start, mid1, i / double(numPoints));
+                Point p2 = getPoint(mid1, mid2, i / double(numPoints));
+                Point p3 = getPoint(mid2, end, i / double(numPoints));
+                Point p4 = getPoint(p1, p2, i / double(numPoints));
+                Point p5 = getPoint(p2, p3, i / double(numPoints));
+                Point p6 = getPoint(p4, p5, i / double(numPoints));
+                points.emplace_back(p6.x, p6.y);
+            }
+        }
+        return points;
+    }
+
+    bool RoadNet::loadFromJson(std::string jsonFileName, double segmentLength) {
+        std::string text;
+        if (!readTextFromFile(jsonFileName, text)) {
             std::cerr << "cannot open roadnet file" << std::endl;
             return false;
         }
+        size_t hash = std::hash<std::string>()(text);
+        // a new source gets the geometry built here, a shared one already has it
+        std::shared_ptr<RoadNetSource> built;
+        source = findSource(jsonFileName, hash, text);
+        if (!source) {
+            built = std::make_shared<RoadNetSource>();
+            readJsonFromString(text, built->document);
+            built->text.swap(text);
+            source = built;
+        }
+        std::string().swap(text);
+        const rapidjson::Document &document = source->document;
+        size_t geometryIndex = 0;
         //std::clog << root << std::endl;
         std::list<std::string> path;
         if (!document.IsObject())
@@ -125,7 +203,12 @@ namespace CityFlow {
             assert(path.empty());
 
             for (rapidjson::SizeType i = 0; i < roadValues.Size(); i++) {
-                roads[i].initLanesPoints();
+                if (built) {
+                    roads[i].initLanesPoints();
+                } else {
+                    for (Lane &lane : roads[i].lanes)
+                        lane.setGeometry(source->drivableGeometry[geometryIndex++]);
+                }
             }
 
             //  read intersections
@@ -201,55 +284,16 @@ namespace CityFlow {
                         Lane *startLane = &roadLink.startRoad->lanes[startLaneIndex];
                         Lane *endLane = &roadLink.endRoad->lanes[endLaneIndex];
 
-                        auto iter = laneLinkValue.FindMember("points");
-                        if (iter != laneLinkValue.MemberEnd() && !iter->value.IsArray())
-                            throw JsonTypeError("points in laneLink", "array");
-                        if (iter != laneLinkValue.MemberEnd() && !iter->value.Empty())
-                            for (const auto &pValue : iter->value.GetArray()) {
-                                laneLink.points.emplace_back(getJsonMember<double>("x", pValue),
-                                                             getJsonMember<double>("y", pValue));
-                            }
-                        else {
-                            Point start = Point(startLane->getPointByDistance(
-                                    startLane->getLength() - startLane->getEndIntersection()->width));
-                            Point end = Point(
-                                    endLane->getPointByDistance(0.0 + endLane->getStartIntersection()->width));
-                            double len = (Point(end.x - start.x, end.y - start.y)).len();
-                            Point startDirection = startLane->getDirectionByDistance(
-                                    startLane->getLength() - startLane->getEndIntersection()->width);
-                            Point endDirection = endLane->getDirectionByDistance(
-                                    0.0 + endLane->getStartIntersection()->width);
-                            double minGap = 5;
-                            double gap1X = startDirection.x * len * 0.5;
-                            double gap1Y = startDirection.y * len * 0.5;
-                            double gap2X = -endDirection.x * len * 0.5;
-                            double gap2Y = -endDirection.y * len * 0.5;
-                            if (gap1X * gap1X + gap1Y * gap1Y < 25 && startLane->getEndIntersection()->width >= 5) {
-                                gap1X = minGap * startDirection.x;
-                                gap1Y = minGap * startDirection.y;
-                            }
-                            if (gap2X * gap2X + gap2Y * gap2Y < 25 && endLane->getStartIntersection()->width >= 5) {
-                                gap2X = minGap * endDirection.x;
-                                gap2Y = minGap * endDirection.y;
-                            }
-                            Point mid1 = Point(start.x + gap1X,start.y + gap1Y);
-                            Point mid2 = Point(end.x + gap2X,end.y + gap2Y);
-                            int numPoints = 10;
-                            for (int i = 0; i <= numPoints; i++) {
-                                Point p1 = getPoint(start, mid1, i / double(numPoints));
-                                Point p2 = getPoint(mid1, mid2, i / double(numPoints));
-                                Point p3 = getPoint(mid2, end, i / double(numPoints));
-                                Point p4 = getPoint(p1, p2, i / double(numPoints));
-                                Point p5 = getPoint(p2, p3, i / double(numPoints));
-                                Point p6 = getPoint(p4, p5, i / double(numPoints));
-                                laneLink.points.emplace_back(p6.x, p6.y);
-                            }
-                        }
+                        if (built)
+                            laneLink.setGeometry(std::make_shared<DrivableGeometry>(
+                                    getLaneLinkPoints(laneLinkValue, startLane, endLane)));
+                        else
+                            laneLink.setGeometry(source->drivableGeometry[geometryIndex++]);
                         laneLink.roadLink = &roadLink;
 
                         laneLink.startLane = startLane;
                         laneLink.endLane = endLane;
-                        laneLink.length = getLengthOfPoints(laneLink.points);
+                        laneLink.id = startLane->getId() + "_TO_" + endLane->getId();
                         startLane->laneLinks.push_back(&laneLink);
                         drivableMap.emplace(laneLink.getId(), &laneLink);
                         path.pop_back();
@@ -300,15 +344,22 @@ namespace CityFlow {
             return false;
         }
 
-        for (auto &intersection : intersections)
-            intersection.initCrosses();
+        for (size_t i = 0; i < intersections.size(); ++i) {
+            if (built) built->crossGeometry.push_back(intersections[i].findCrosses());
+            intersections[i].initCrosses(source->crossGeometry[i]);
+        }
         VehicleInfo vehicleTemplate;
+        if (segmentLength <= 0)
+            segmentLength = (vehicleTemplate.len + vehicleTemplate.minGap) * DEFAULT_NUM_CARS_ON_SEGMENT;
 
-        for (auto &road : roads)
-            road.initLanesPoints();
+        // the lanes were first built before the intersection widths were known, for the lane links
+        if (built) {
+            for (auto &road : roads)
+                road.initLanesPoints();
+        }
 
         for (auto &road : roads) {
-            road.buildSegmentationByInterval((vehicleTemplate.len + vehicleTemplate.minGap) * MAX_NUM_CARS_ON_SEGMENT);
+            road.buildSegmentationByInterval(segmentLength);
         }
 
         for (auto &road : roads) {
@@ -321,6 +372,17 @@ namespace CityFlow {
             laneLinks.insert(laneLinks.end(), intersectionLaneLinks.begin(), intersectionLaneLinks.end());
             drivables.insert(drivables.end(), intersectionLaneLinks.begin(), intersectionLaneLinks.end());
         }
+        for (size_t i = 0; i < drivables.size(); ++i)
+            drivables[i]->roadnetIndex = i;
+        historyRecords.assign(lanes.size() * Lane::historyCapacity, Lane::HistoryRecord());
+        for (size_t i = 0; i < lanes.size(); ++i)
+            lanes[i]->history = &historyRecords[i * Lane::historyCapacity];
+
+        if (built) {
+            for (Drivable *drivable : drivables)
+                built->drivableGeometry.push_back(drivable->geometry);
+            addSource(jsonFileName, hash, source);
+        }
         return true;
     }
 
@@ -393,22 +455,73 @@ namespace CityFlow {
         return jsonRoot;
     }
 
+    DrivableGeometry::DrivableGeometry(std::vector<Point> points)
+        : points(std::move(points)), length(getLengthOfPoints(this->points)), cumulativeLengths(1, 0.0) {
+        double total = 0.0;
+        for (size_t i = 0; i + 1 < this->points.size(); i++) {
+            Vector piece = this->points[i + 1] - this->points[i];
+            pieceLengths.push_back(piece.len());
+            pieceDirections.push_back(piece.unit());
+            total += pieceLengths.back();
+            cumulativeLengths.push_back(total);
+        }
+    }
+
+    void Drivable::setGeometry(std::shared_ptr<const DrivableGeometry> geometry) {
+        this->geometry = std::move(geometry);
+        length = this->geometry->length;
+    }
+
+    size_t Drivable::getPieceByDistance(double dis, size_t hint) const {
+        const std::vector<double> &cumulativeLengths = geometry->cumulativeLengths;
+        // the piece ending at the first cumulative length not below dis
+        if (hint < geometry->pieceLengths.size() && cumulativeLengths[hint] < dis && dis <= cumulativeLengths[hint + 1])
+            return hint;
+        return std::lower_bound(cumulativeLengths.begin() + 1, cumulativeLengths.end(), dis)
+               - cumulativeLengths.begin() - 1;
+    }
+
+    Point Drivable::getPointOnPiece(double dis, size_t piece) const {
+        const std::vector<Point> &points = geometry->points;
+        const std::vector<double> &pieceLengths = geometry->pieceLengths;
+        if (dis <= 0.0)
+            return points[0];
+        if (piece >= pieceLengths.size())
+            return points.back();
+        return points[piece] + (points[piece + 1] - points[piece]) *
+                               ((dis - geometry->cumulativeLengths[piece]) / pieceLengths[piece]);
+    }
+
     Point Drivable::getPointByDistance(double dis) const {
-        return CityFlow::getPointByDistance(points, dis);
+        dis = min2double(max2double(dis, 0), geometry->cumulativeLengths.back());
+        return getPointOnPiece(dis, getPieceByDistance(dis, 0));
     }
 
     Point Drivable::getDirectionByDistance(double dis) const {
-        double remain = dis;
-        for (int i = 0; i + 1 < (int) points.size(); i++) {
-            double len = (points[i + 1] - points[i]).len();
-            if (remain < len)
-                return (points[i + 1] - points[i]).unit();
-            else
-                remain -= len;
+        const std::vector<double> &cumulativeLengths = geometry->cumulativeLengths;
+        const std::vector<Point> &pieceDirections = geometry->pieceDirections;
+        // the first piece ending beyond dis, or the last one
+        size_t piece = std::upper_bound(cumulativeLengths.begin() + 1, cumulativeLengths.end(), dis)
+                       - cumulativeLengths.begin() - 1;
+        return pieceDirections[std::min(piece, pieceDirections.size() - 1)];
+    }
+
+    CITYFLOW_MULTIVERSION
+    void Drivable::getPointsByDistances(const double *distances, size_t count, Point *result,
+                                        Point *directions) const {
+        // each lookup starts from the previous piece, vehicles in lane order hit it or a neighbour
+        size_t piece = 0;
+        for (size_t i = 0; i < count; ++i) {
+            double dis = min2double(max2double(distances[i], 0), geometry->cumulativeLengths.back());
+            piece = getPieceByDistance(dis, piece);
+            result[i] = getPointOnPiece(dis, piece);
+            if (directions)
+                directions[i] = getDirectionByDistance(distances[i]);
         }
-        return (points[points.size() - 1] - points[points.size() - 2]).unit();
     }
 
+    constexpr size_t Lane::historyCapacity; // odr-used by std::min
+
     Lane::Lane() {
         width = 0;
         maxSpeed = 0;
@@ -423,6 +536,7 @@ namespace CityFlow {
         this->laneIndex = laneIndex;
         this->belongRoad = belongRoad;
         drivableType = LANE;
+        id = belongRoad->getId() + '_' + std::to_string(laneIndex);
     }
 
     bool Lane::available(const Vehicle *vehicle) const {
@@ -476,10 +590,9 @@ namespace CityFlow {
         for (Lane &lane : lanes) {
             double dmin = dsum;
             double dmax = dsum + lane.width;
-            lane.points.clear();
+            std::vector<Point> lanePoints;
             for (int j = 0; j < (int) roadPoints.size(); j++) {
                 // TODO: the '(dmin + dmax) / 2.0' is wrong
-                std::vector<Point> &lanePoints = lane.points;
                 if (j == 0) {
                     Vector u = (roadPoints[1] - roadPoints[0]).unit();
                     Vector v = -u.normal();
@@ -499,7 +612,7 @@ namespace CityFlow {
                     lanePoints.push_back(interPoint);
                 }
             }
-            lane.length = getLengthOfPoints(lane.points);
+            lane.setGeometry(std::make_shared<DrivableGeometry>(std::move(lanePoints)));
             dsum += lane.width;
         }
     }
@@ -512,20 +625,17 @@ namespace CityFlow {
         return lanePointers;
     }
 
-    void Intersection::initCrosses() {
-        std::vector<LaneLink *> allLaneLinks;
-        for (auto &roadLink : roadLinks) {
-            for (auto &laneLink : roadLink.getLaneLinks())
-                allLaneLinks.push_back(&laneLink);
-        }
+    std::vector<CrossGeometry> Intersection::findCrosses() {
+        const std::vector<LaneLink *> &allLaneLinks = getLaneLinks();
+        std::vector<CrossGeometry> found;
         int n = (int) allLaneLinks.size();
 
         for (int i = 0; i < n; i++) {
             for (int j = i + 1; j < n; j++) {
                 LaneLink *la = allLaneLinks[i];
                 LaneLink *lb = allLaneLinks[j];
-                std::vector<Point> &va = la->points;
-                std::vector<Point> &vb = lb->points;
+                const std::vector<Point> &va = la->geometry->points;
+                const std::vector<Point> &vb = lb->geometry->points;
                 double disa = 0.0;
                 for (int ia = 0; ia + 1 < (int) va.size(); ia++) {
                     double disb = 0.0;
@@ -535,11 +645,9 @@ namespace CityFlow {
                         if (Point::sign(crossMultiply(A2 - A1, B2 - B1)) == 0) continue;
                         Point P = calcIntersectPoint(A1, A2, B1, B2);
                         if (onSegment(A1, A2, P) && onSegment(B1, B2, P)) {
-                            Cross cross;
-                            cross.laneLinks[0] = la;
-                            cross.laneLinks[1] = lb;
-                            cross.notifyVehicles[0] = nullptr;
-                            cross.notifyVehicles[1] = nullptr;
+                            CrossGeometry cross;
+                            cross.laneLinks[0] = i;
+                            cross.laneLinks[1] = j;
                             cross.distanceOnLane[0] = disa + (P - A1).len();
                             cross.distanceOnLane[1] = disb + (P - B1).len();
                             cross.ang = calcAng(A2 - A1, B2 - B1);
@@ -551,7 +659,7 @@ namespace CityFlow {
                             double diag = (c1 * c1 + c2 * c2 + 2 * c1 * c2 * cos(cross.ang)) / 4;
                             cross.safeDistances[0] = sqrt(diag - w2 * w2 / 4);
                             cross.safeDistances[1] = sqrt(diag - w1 * w1 / 4);
-                            this->crosses.push_back(cross);
+                            found.push_back(cross);
                             goto FOUND;
                         }
                         disb += (vb[ib + 1] - vb[ib]).len();
@@ -561,6 +669,23 @@ namespace CityFlow {
 FOUND:;
             }
         }
+        return found;
+    }
+
+    void Intersection::initCrosses(const std::vector<CrossGeometry> &geometry) {
+        const std::vector<LaneLink *> &allLaneLinks = getLaneLinks();
+        crosses.reserve(geometry.size());
+        for (const CrossGeometry &found : geometry) {
+            Cross cross;
+            for (int k = 0; k < 2; ++k) {
+                cross.laneLinks[k] = allLaneLinks[found.laneLinks[k]];
+                cross.notifyVehicles[k] = nullptr;
+                cross.distanceOnLane[k] = found.distanceOnLane[k];
+                cross.safeDistances[k] = found.safeDistances[k];
+            }
+            cross.ang = found.ang;
+            crosses.push_back(cross);
+        }
         for (Cross &cross : this->crosses) {
             cross.laneLinks[0]->getCrosses().push_back(&cross);
             cross.laneLinks[1]->getCrosses().push_back(&cross);
@@ -832,15 +957,17 @@ FOUND:;
     void Lane::reset() {
         waitingBuffer.clear();
         vehicles.clear();
+        for (Segment &segment : segments)
+            segment.first = segment.last = 0;
     }
 
     std::vector<Vehicle *> Lane::getVehiclesBeforeDistance(double dis, size_t segmentIndex, double deltaDis) {
         std::vector<Vehicle *> ret;
         for (int i = segmentIndex; i >=0 ;i--) {
             Segment * segment = getSegment(i);
-            auto &vehicles = segment->getVehicles();
+            VehicleRange vehicles = segment->getVehicles();
             for(auto it = vehicles.begin(); it != vehicles.end(); ++it) {
-                Vehicle *vehicle = *(*it);
+                Vehicle *vehicle = *it;
                 if (vehicle->getDistance() < dis - deltaDis) return ret;
                 if (vehicle->getDistance() < dis) ret.emplace_back(vehicle);
             }
@@ -853,7 +980,7 @@ FOUND:;
         this->segments.resize((unsigned) numSegs);
         for (size_t i = 0; i < numSegs; i++) {
             segments[i].index = i;
-            segments[i].vehicles.clear();
+            segments[i].first = segments[i].last = 0;
             segments[i].belongLane = this;
             segments[i].startPos = i * this->length / numSegs;
             segments[i].endPos = (i + 1) * this->length / numSegs;
@@ -861,25 +988,69 @@ FOUND:;
     }
 
     void Lane::initSegments() {
-        auto iter = this->vehicles.begin();
-        auto end = this->vehicles.end();
-        for (int i = (int) segments.size() - 1; i >= 0; i--) {
-            Segment &seg = segments[i];
-            seg.vehicles.clear();
-            while (iter != end && (*iter)->getDistance() >= seg.getStartPos()) {
-                seg.vehicles.push_back(iter);
-                (*iter)->setSegmentIndex(seg.index);
-                ++iter;
-            }
+        size_t position = 0;
+        size_t current = segments.size() - 1;
+        segments[current].first = 0;
+        for (Vehicle *vehicle : vehicles)
+            placeInSegment(vehicle, position++, current);
+        closeSegments(position, current);
+    }
+
+    void Lane::placeInSegment(Vehicle *vehicle, size_t position, size_t &current) {
+        // vehicles never pass each other on a lane, a segment index only goes down along it
+        size_t index = std::min(locateSegment(vehicle->getNextDistance(), vehicle->getSegmentIndex()), current);
+        while (current > index) {
+            segments[current].last = position;
+            segments[--current].first = position;
+        }
+        vehicle->setSegmentIndex(index);
+    }
+
+    void Lane::closeSegments(size_t count, size_t current) {
+        segments[current].last = count;
+        while (current > 0) {
+            --current;
+            segments[current].first = segments[current].last = count;
+        }
+    }
+
+    void Lane::pushVehicleToSegment(Vehicle *vehicle) {
+        size_t current = vehicles.empty() ? segments.size() - 1 : vehicles.back()->getSegmentIndex();
+        size_t index = std::min(locateSegment(vehicle->getNextDistance(), current), current);
+        vehicles.push_back(vehicle);
+        size_t count = vehicles.size();
+        // the segments below current were empty ranges at the tail, so only their ends move
+        segments[index].last = count;
+        for (size_t i = 0; i < index; ++i)
+            segments[i].first = segments[i].last = count;
+        vehicle->setSegmentIndex(index);
+    }
+
+    size_t Lane::locateSegment(double distance, size_t hint) const {
+        size_t index = std::min(hint, segments.size() - 1);
+        while (index > 0 && distance < segments[index].getStartPos()) --index;
+        while (index + 1 < segments.size() && distance >= segments[index + 1].getStartPos()) ++index;
+        return index;
+    }
+
+    void Lane::insertVehicle(Vehicle *vehicle, size_t segmentIndex) {
+        Segment &seg = segments[segmentIndex];
+        size_t position = seg.first;
+        while (position < seg.last && vehicles[position]->getDistance() >= vehicle->getDistance()) ++position;
+        vehicles.insert(position, vehicle);
+        // segments closer to the start of the lane come later in the array
+        ++seg.last;
+        for (size_t i = 0; i < segmentIndex; ++i) {
+            ++segments[i].first;
+            ++segments[i].last;
         }
     }
 
     Vehicle *Lane::getVehicleBeforeDistance(double dis, size_t segmentIndex) const{
         for (int i = segmentIndex ; i >= 0 ; --i){
-            auto vehs = getSegment(i)->getVehicles();
-            for (auto itr = vehs.begin() ; itr != vehs.end(); ++itr){
-                auto &vehicle = **itr;
-                if (vehicle->getDistance() < dis) return **itr;
+            VehicleRange vehs = getSegment(i)->getVehicles();
+            for (Vehicle *vehicle : vehs){
+                if (vehicle->getDistance() < dis) return vehicle;
             }
         }
 
@@ -888,32 +1059,73 @@ FOUND:;
 
     Vehicle *Lane::getVehicleAfterDistance(double dis, size_t segmentIndex) const{
         for (size_t i = segmentIndex ; i < getSegmentNum() ; ++i){
-            auto vehs = getSegment(i)->getVehicles();
-            for (auto itr = vehs.rbegin() ; itr != vehs.rend(); ++itr){
-                auto &vehicle = **itr;
-                if (vehicle->getDistance() >= dis) return **itr;
+            VehicleRange vehs = getSegment(i)->getVehicles();
+            for (auto itr = vehs.end() ; itr != vehs.begin(); ){
+                Vehicle *vehicle = *--itr;
+                if (vehicle->getDistance() >= dis) return vehicle;
             }
         }
         return nullptr;
     }
 
+    CITYFLOW_MULTIVERSION
     void Lane::updateHistory() {
+        int vehicleNum = vehicles.size();
+        if (vehicleNum == 0 && historyVehicleNum == 0) {
+            // adding an empty record to an empty window changes no statistics
+            ++historySkipped;
+            return;
+        }
+        flushHistory();
         double speedSum = historyVehicleNum * historyAverageSpeed;
-        while (history.size() > historyLen){
-            historyVehicleNum -= history.front().vehicleNum;
-            speedSum -= history.front().vehicleNum * history.front().averageSpeed;
-            history.pop_front();
+        if (historySize == historyCapacity) {
+            const HistoryRecord &oldest = history[historyHead];
+            historyVehicleNum -= oldest.vehicleNum;
+            speedSum -= oldest.vehicleNum * oldest.averageSpeed;
+            historyHead = (historyHead + 1) % historyCapacity;
+            --historySize;
         }
         double curSpeedSum = 0;
-        int vehicleNum = getVehicles().size();
         historyVehicleNum += vehicleNum;
         for (auto vehicle : getVehicles())
             curSpeedSum += vehicle->getSpeed();
         speedSum += curSpeedSum;
-        history.emplace_back(vehicleNum, vehicleNum ? curSpeedSum / vehicleNum : 0);
+        history[(historyHead + historySize++) % historyCapacity] =
+                HistoryRecord(vehicleNum, vehicleNum ? curSpeedSum / vehicleNum : 0);
         historyAverageSpeed = historyVehicleNum ? speedSum / historyVehicleNum : 0;
     }
 
+    void Lane::flushHistory() {
+        for (size_t i = 0; i < std::min(historySkipped, historyCapacity); ++i) {
+            if (historySize == historyCapacity) {
+                historyHead = (historyHead + 1) % historyCapacity;
+                --historySize;
+            }
+            history[(historyHead + historySize++) % historyCapacity] = HistoryRecord();
+        }
+        historySkipped = 0;
+    }
+
+    std::vector<Lane::HistoryRecord> Lane::getHistory() const {
+        std::vector<HistoryRecord> records;
+        for (size_t i = 0; i < historySize; ++i)
+            records.push_back(history[(historyHead + i) % historyCapacity]);
+        records.resize(records.size() + std::min(historySkipped, historyCapacity));
+        if (records.size() > historyCapacity)
+            records.erase(records.begin(), records.end() - historyCapacity);
+        return records;
+    }
+
+    void Lane::setHistory(const std::vector<HistoryRecord> &records, int vehicleNum, double averageSpeed) {
+        size_t first = records.size() > historyCapacity ? records.size() - historyCapacity : 0;
+        historyHead = 0;
+        historySize = records.size() - first;
+        historySkipped = 0;
+        std::copy(records.begin() + first, records.end(), history);
+        historyVehicleNum = vehicleNum;
+        historyAverageSpeed = averageSpeed;
+    }
+
     int Lane::getHistoryVehicleNum() const{
         return historyVehicleNum;
     }
@@ -924,26 +1136,9 @@ FOUND:;
 
     void Cross::reset() { }
 
-    std::list<Vehicle *>::iterator Segment::findVehicle(Vehicle *vehicle) {
-        for (auto itr = vehicles.begin() ; itr != vehicles.end() ; ++itr)
-            if (**itr == vehicle) {
-                return *itr;
-            }
-        return belongLane->getVehicles().end();
-    }
-
-    void Segment::removeVehicle(Vehicle *vehicle) {
-        for (auto itr = vehicles.begin() ; itr != vehicles.end() ; ++itr)
-            if (**itr == vehicle) {
-                vehicles.erase(itr);
-                return;
-            }
-    }
-
-    void Segment::insertVehicle(std::list<Vehicle *>::iterator &vehicle) {
-        auto itr = vehicles.begin();
-        for (; itr != vehicles.end() && (**itr)->getDistance() > (*vehicle)->getDistance() ; ++itr);
-        vehicles.insert(itr, vehicle);
+    VehicleRange Segment::getVehicles() const {
+        const VehicleArray &vehicles = belongLane->getVehicles();
+        return VehicleRange(vehicles.begin() + first, vehicles.begin() + last);
     }
 
 }
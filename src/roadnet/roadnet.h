@@ -2,10 +2,12 @@
 #define CITYFLOW_ROADNET_H
 
 #include "roadnet/trafficlight.h"
+#include "roadnet/vehiclearray.h"
 #include "utility/utility.h"
 
 #include <list>
 #include <map>
+#include <memory>
 #include <queue>
 #include <iostream>
 
@@ -24,6 +26,36 @@ namespace CityFlow {
 
     class Cross;
 
+    // Polyline of a drivable and its lookup tables. It never changes once built, so roadnets
+    // loaded from the same file share it.
+    struct DrivableGeometry {
+        std::vector<Point> points;
+        double length;
+        std::vector<double> cumulativeLengths; // length up to each point
+        std::vector<double> pieceLengths;
+        std::vector<Point> pieceDirections;    // unit vector of each piece
+
+        explicit DrivableGeometry(std::vector<Point> points);
+    };
+
+    // two crossing lane links of an intersection, given by their position in getLaneLinks()
+    struct CrossGeometry {
+        size_t laneLinks[2];
+        double distanceOnLane[2];
+        double ang;
+        double safeDistances[2];
+    };
+
+    // What no simulation changes in a roadnet file: its json, the geometry of the drivables,
+    // indexed like RoadNet::getDrivables(), and the crosses of each intersection, indexed like
+    // RoadNet::getIntersections(). Roadnets loaded from the same file and content share one.
+    struct RoadNetSource {
+        std::string text; // of the file, a cached source is only reused for the same text
+        rapidjson::Document document;
+        std::vector<std::shared_ptr<const DrivableGeometry>> drivableGeometry;
+        std::vector<std::vector<CrossGeometry>> crossGeometry;
+    };
+
     class Segment {
         friend Lane;
     public:
@@ -40,25 +72,16 @@ namespace CityFlow {
 
         size_t getIndex() const { return this->index; }
 
-        const std::list<std::list<Vehicle *>::iterator> &getVehicles() const { return this->vehicles; }
-
-        std::list<std::list<Vehicle *>::iterator> &getVehicles() { return this->vehicles; }
-
-//        std::list<Vehicle *>::iterator getPrevVehicleIter() const { return this->prev_vehicle_iter; }
-
-        std::list<Vehicle *>::iterator findVehicle(Vehicle * vehicle);
-
-        void removeVehicle(Vehicle * vehicle);
-
-        void insertVehicle(std::list<Vehicle *> ::iterator &vehicle);
+        // vehicles of the lane inside this segment, in lane order
+        VehicleRange getVehicles() const;
 
     private:
         size_t index = 0;
         Lane *belongLane = nullptr;
         double startPos = 0;
         double endPos = 0;
-        std::list<std::list<Vehicle *>::iterator> vehicles;
-        std::list<Vehicle *>::iterator prev_vehicle_iter;
+        size_t first = 0; // vehicles [first, last) of the lane, counted from its front
+        size_t last = 0;
     };
 
     class Intersection {
@@ -81,10 +104,12 @@ namespace CityFlow {
         std::vector<Cross> crosses;
         std::vector<LaneLink *> laneLinks;
 
-        void initCrosses();
+        std::vector<CrossGeometry> findCrosses();
+
+        void initCrosses(const std::vector<CrossGeometry> &geometry);
 
     public:
-        std::string getId() const { return this->id; }
+        const std::string &getId() const { return this->id; }
 
         const TrafficLight &getTrafficLight() const { return trafficLight; }
 
@@ -189,7 +214,7 @@ namespace CityFlow {
         void initLanesPoints();
 
     public:
-        std::string getId() const { return id; }
+        const std::string &getId() const { return id; }
 
         const Intersection &getStartIntersection() const { return *(this->startIntersection); }
 
@@ -242,16 +267,24 @@ namespace CityFlow {
         double length;
         double width;
         double maxSpeed;
-        std::list<Vehicle *> vehicles;
-        std::vector<Point> points;
+        VehicleArray vehicles;
+        std::shared_ptr<const DrivableGeometry> geometry;
         DrivableType drivableType;
+        std::string id; // built once when the roadnet is loaded
+        // position in RoadNet::getDrivables(), lanes come first so for a lane it is also its
+        // position in RoadNet::getLanes()
+        size_t roadnetIndex = 0;
+
+        size_t getPieceByDistance(double dis, size_t hint) const;
+
+        Point getPointOnPiece(double dis, size_t piece) const;
 
     public:
         virtual ~Drivable() = default;
 
-        const std::list<Vehicle *> &getVehicles() const { return vehicles; }
+        const VehicleArray &getVehicles() const { return vehicles; }
 
-        std::list<Vehicle *> &getVehicles() { return vehicles; }
+        VehicleArray &getVehicles() { return vehicles; }
 
         double getLength() const { return length; }
 
@@ -263,6 +296,8 @@ namespace CityFlow {
 
         DrivableType getDrivableType() const { return drivableType; }
 
+        size_t getRoadnetIndex() const { return roadnetIndex; }
+
         bool isLane() const { return drivableType == LANE; }
 
         bool isLaneLink() const { return drivableType == LANELINK; }
@@ -281,13 +316,18 @@ namespace CityFlow {
 
         Point getDirectionByDistance(double dis) const;
 
+        // fills points (and directions, unless null) for count distances, fastest in lane order
+        void getPointsByDistances(const double *distances, size_t count, Point *points, Point *directions) const;
+
+        void setGeometry(std::shared_ptr<const DrivableGeometry> geometry);
+
         void pushVehicle(Vehicle *vehicle) {
             vehicles.push_back(vehicle);
         }
 
         void popVehicle() { vehicles.pop_front(); }
 
-        virtual std::string getId() const = 0;
+        const std::string &getId() const { return id; }
     };
 
     class Lane : public Drivable {
@@ -303,27 +343,40 @@ namespace CityFlow {
         Road *belongRoad = nullptr;
         std::deque<Vehicle *> waitingBuffer;
 
+        // puts the vehicle at position into its segment, current is the segment of the one before
+        void placeInSegment(Vehicle *vehicle, size_t position, size_t &current);
+
+        // ends the ranges after count vehicles were placed, current holds the last one
+        void closeSegments(size_t count, size_t current);
+
         struct HistoryRecord {
-            int vehicleNum;
-            double averageSpeed;
+            int vehicleNum = 0;
+            double averageSpeed = 0;
+            HistoryRecord() = default;
             HistoryRecord(int vehicleNum, double averageSpeed) : vehicleNum(vehicleNum), averageSpeed(averageSpeed) {}
         };
-        std::list<HistoryRecord> history;
+
+        static constexpr int historyLen = 240;
+        // records in the window, the oldest one is dropped right before a new one is added
+        static constexpr size_t historyCapacity = historyLen + 1;
+
+        // ring of historyCapacity records inside the block of the roadnet
+        HistoryRecord *history = nullptr;
+        size_t historyHead = 0;
+        size_t historySize = 0;
+        // steps of an empty lane whose window is all empty, their records are not written yet
+        size_t historySkipped = 0;
 
         int    historyVehicleNum = 0;
         double historyAverageSpeed = 0;
 
-        static constexpr int historyLen = 240;
+        void flushHistory();
 
     public:
         Lane();
 
         Lane(double width, double maxSpeed, int laneIndex, Road *belongRoad);
 
-        std::string getId() const override{
-            return belongRoad->getId() + '_' + std::to_string(getLaneIndex());
-        }
-
         Road *getBelongRoad() const { return this->belongRoad; }
 
         bool available(const Vehicle *vehicle) const;
@@ -369,8 +422,34 @@ namespace CityFlow {
         /* segmentation */
         void buildSegmentation(size_t numSegs);
 
+        // rebuilds the segment ranges from scratch, after the vehicles were replaced
         void initSegments();
 
+        // Removes the vehicles for which leaves is true. The others move on to the segment of
+        // the distance they reach this step, in the same pass, so the ranges stay current.
+        template <typename Predicate>
+        void eraseVehiclesIf(Predicate leaves) {
+            if (vehicles.empty()) return;
+            size_t position = 0;
+            size_t current = segments.size() - 1;
+            segments[current].first = 0;
+            vehicles.eraseIf([&](Vehicle *vehicle) {
+                if (leaves(vehicle)) return true;
+                placeInSegment(vehicle, position++, current);
+                return false;
+            });
+            closeSegments(position, current);
+        }
+
+        // appends a vehicle at the tail, into the segment of its distance at the end of the step
+        void pushVehicleToSegment(Vehicle *vehicle);
+
+        // segment that contains the distance, searched from a nearby segment
+        size_t locateSegment(double distance, size_t hint) const;
+
+        // inserts a vehicle between the others of its segment, by distance
+        void insertVehicle(Vehicle *vehicle, size_t segmentIndex);
+
         const Segment *getSegment(size_t index) const { return &segments[index]; }
 
         Segment *getSegment(size_t index) { return &segments[index]; }
@@ -390,6 +469,11 @@ namespace CityFlow {
 
         double getHistoryAverageSpeed() const;
 
+        // records of the window, oldest first
+        std::vector<HistoryRecord> getHistory() const;
+
+        void setHistory(const std::vector<HistoryRecord> &records, int vehicleNum, double averageSpeed);
+
 
         Vehicle* getVehicleBeforeDistance(double dis, size_t segmentIndex) const; //TODO: set a limit, not too far way
 
@@ -474,10 +558,6 @@ namespace CityFlow {
         bool isTurn() const { return roadLink->isTurn(); }
 
         void reset();
-
-        std::string getId() const override {
-            return (startLane ? startLane->getId() : "") + "_TO_" + (endLane ? endLane->getId() : "");
-        }
     };
 
 
@@ -492,10 +572,19 @@ namespace CityFlow {
         std::vector<Lane *> lanes;
         std::vector<LaneLink *> laneLinks;
         std::vector<Drivable *> drivables;
+        std::vector<Lane::HistoryRecord> historyRecords; // history rings of all lanes
+        std::shared_ptr<const RoadNetSource> source;
         Point getPoint(const Point &p1, const Point &p2, double a);
 
+        std::vector<Point> getLaneLinkPoints(const rapidjson::Value &laneLinkValue, const Lane *startLane,
+                                             const Lane *endLane);
+
     public:
-        bool loadFromJson(std::string jsonFileName);
+        // segmentLength <= 0 picks the default. A file already loaded by another roadnet
+        // with the same content is not parsed again, its source is shared instead.
+        bool loadFromJson(std::string jsonFileName, double segmentLength = 0);
+
+        const std::shared_ptr<const RoadNetSource> &getSource() const { return source; }
 
         rapidjson::Value convertToJson(rapidjson::Document::AllocatorType &allocator);
 
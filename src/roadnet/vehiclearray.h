@@ -0,0 +1,95 @@
+#ifndef CITYFLOW_VEHICLEARRAY_H
+#define CITYFLOW_VEHICLEARRAY_H
+
+#include <cstddef>
+#include <vector>
+
+namespace CityFlow {
+    class Vehicle;
+
+    // Vehicles of a drivable from the head of the traffic to its tail, kept contiguous.
+    // Vehicles leave at the front by moving a head offset, the dead prefix is reclaimed
+    // once it outgrows the live part or by the next compaction.
+    class VehicleArray {
+    public:
+        typedef std::vector<Vehicle *>::iterator iterator;
+        typedef std::vector<Vehicle *>::const_iterator const_iterator;
+
+        iterator begin() { return items.begin() + head; }
+
+        iterator end() { return items.end(); }
+
+        const_iterator begin() const { return items.begin() + head; }
+
+        const_iterator end() const { return items.end(); }
+
+        size_t size() const { return items.size() - head; }
+
+        bool empty() const { return items.size() == head; }
+
+        Vehicle *front() const { return items[head]; }
+
+        Vehicle *back() const { return items.back(); }
+
+        Vehicle *operator[](size_t index) const { return items[head + index]; }
+
+        void push_back(Vehicle *vehicle) { items.push_back(vehicle); }
+
+        void pop_front() {
+            if (++head == items.size()) {
+                clear();
+            } else if (head >= MIN_RECLAIM && head * 2 >= items.size()) {
+                items.erase(items.begin(), items.begin() + head);
+                head = 0;
+            }
+        }
+
+        // index counts from the front, the vehicles behind it move back by one
+        void insert(size_t index, Vehicle *vehicle) { items.insert(items.begin() + head + index, vehicle); }
+
+        // Removes the vehicles matching the predicate in one pass, keeping the order of the
+        // others. The predicate sees every vehicle once, from the front to the back.
+        template <typename Predicate>
+        void eraseIf(Predicate predicate) {
+            size_t kept = 0;
+            for (size_t i = head; i < items.size(); ++i) {
+                Vehicle *vehicle = items[i];
+                if (!predicate(vehicle)) items[kept++] = vehicle;
+            }
+            items.resize(kept);
+            head = 0;
+        }
+
+        void clear() {
+            items.clear();
+            head = 0;
+        }
+
+    private:
+        static const size_t MIN_RECLAIM = 16;
+
+        std::vector<Vehicle *> items;
+        size_t head = 0;
+    };
+
+    // a run of consecutive vehicles of a VehicleArray, valid until the array changes
+    class VehicleRange {
+    public:
+        typedef VehicleArray::const_iterator const_iterator;
+
+        VehicleRange(const_iterator first, const_iterator last) : first(first), last(last) { }
+
+        const_iterator begin() const { return first; }
+
+        const_iterator end() const { return last; }
+
+        size_t size() const { return last - first; }
+
+        bool empty() const { return first == last; }
+
+    private:
+        const_iterator first, last;
+    };
+}
+
+#endif //CITYFLOW_VEHICLEARRAY_H
@@ -1,7 +1,53 @@
 #include "barrier.h"
 
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
 namespace CityFlow {
-    void Barrier::wait() {
+    thread_local std::size_t Barrier::participantId = 0;
+
+    BarrierType parseBarrierType(const std::string &name) {
+        if (name == "blocking") return BarrierType::BLOCKING;
+        if (name == "spin") return BarrierType::SPIN;
+        if (name == "dissemination") return BarrierType::DISSEMINATION;
+        throw std::invalid_argument("unknown barrier type: " + name);
+    }
+
+    std::unique_ptr<Barrier> Barrier::create(BarrierType type, std::size_t nb_threads) {
+        switch (type) {
+            case BarrierType::BLOCKING:
+                return std::unique_ptr<Barrier>(new BlockingBarrier(nb_threads));
+            case BarrierType::DISSEMINATION:
+                return std::unique_ptr<Barrier>(new DisseminationBarrier(nb_threads));
+            case BarrierType::SPIN:
+            default:
+                return std::unique_ptr<Barrier>(new SpinBarrier(nb_threads));
+        }
+    }
+
+    Parker::Parker(std::size_t participants) : sleepers(0) {
+        // spinning only pays off when every participant has a core of its own
+        bool oversubscribed = participants > std::thread::hardware_concurrency();
+        minSpin = oversubscribed ? 0 : 64;
+        spinLimit = oversubscribed ? 0 : 1024;
+    }
+
+    void Parker::relax(int iteration) {
+        if ((iteration & 63) == 63) {
+            std::this_thread::yield();
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+        _mm_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    void BlockingBarrier::wait() {
         std::unique_lock<std::mutex> lock(m_mutex);
         assert(0u != *currCounter);
         if (!--*currCounter) {
@@ -13,4 +59,43 @@ namespace CityFlow {
             m_condition.wait(lock, [currCounter_local] { return *currCounter_local == 0; });
         }
     }
-}
\ No newline at end of file
+
+    void SpinBarrier::wait() {
+        size_t gen = generation.load(std::memory_order_acquire);
+        if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == m_threads) {
+            // nobody can arrive for the next round before generation moves on
+            arrived.store(0, std::memory_order_relaxed);
+            generation.store(gen + 1);
+            parker.wakeAll();
+            return;
+        }
+        parker.await([this, gen] { return generation.load(std::memory_order_acquire) != gen; });
+    }
+
+    DisseminationBarrier::DisseminationBarrier(std::size_t nb_threads) : Barrier(nb_threads), parker(nb_threads) {
+        while (((size_t) 1 << rounds) < m_threads) ++rounds;
+        for (size_t i = 0; i < m_threads; ++i) {
+            nodes.emplace_back(new Node());
+            for (auto &parityFlags : nodes.back()->flags)
+                for (auto &flag : parityFlags)
+                    flag.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    void DisseminationBarrier::wait() {
+        size_t id = getParticipantId();
+        assert(id < m_threads);
+        Node &self = *nodes[id];
+        int parity = self.parity;
+        bool sense = self.sense;
+        for (size_t round = 0; round < rounds; ++round) {
+            Node &partner = *nodes[(id + ((size_t) 1 << round)) % m_threads];
+            partner.flags[parity][round].store(sense);
+            parker.wakeAll();
+            std::atomic<bool> &flag = self.flags[parity][round];
+            parker.await([&flag, sense] { return flag.load(std::memory_order_acquire) == sense; });
+        }
+        if (parity == 1) self.sense = !sense;
+        self.parity = 1 - parity;
+    }
+}
@@ -1,18 +1,30 @@
 #ifndef CITYFLOW_BARRIER_H
 #define CITYFLOW_BARRIER_H
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 namespace CityFlow {
+
+    enum class BarrierType {
+        BLOCKING,       // mutex + condition variable, always sleeps
+        SPIN,           // sense-reversing counter, adaptive spin then park
+        DISSEMINATION   // log2(n) rounds of pairwise signals, adaptive spin then park
+    };
+
+    BarrierType parseBarrierType(const std::string &name);
+
     class Barrier {
     public:
-        Barrier(std::size_t nb_threads) : m_threads(nb_threads), currCounter(&counter[0]) {
+        explicit Barrier(std::size_t nb_threads) : m_threads(nb_threads) {
             assert(0u != m_threads);
-            counter[0] = m_threads;
-            counter[1] = 0;
         }
 
         Barrier(const Barrier& barrier) = delete;
@@ -23,14 +35,117 @@ namespace CityFlow {
 
         Barrier& operator=(Barrier&& barrier) = delete;
 
-        void wait();
+        virtual ~Barrier() = default;
+
+        virtual void wait() = 0;
+
+        std::size_t getThreadNum() const { return m_threads; }
+
+        static std::unique_ptr<Barrier> create(BarrierType type, std::size_t nb_threads);
+
+        // Index of the calling thread among the participants, in [0, nb_threads).
+        // Only barriers with per-participant state (dissemination) need it.
+        static void setParticipantId(std::size_t id) { participantId = id; }
+
+        static std::size_t getParticipantId() { return participantId; }
+
+    protected:
+        const size_t m_threads;
+
+    private:
+        static thread_local std::size_t participantId;
+    };
+
+    // Spin for a while before sleeping on a condition variable. The spin budget adapts:
+    // it grows while waits finish during the spin and shrinks when they end up parked,
+    // so workers idling between two nextStep calls fall asleep quickly.
+    class Parker {
+    public:
+        explicit Parker(std::size_t participants);
+
+        template <typename Predicate>
+        void await(Predicate ready) {
+            int limit = spinLimit.load(std::memory_order_relaxed);
+            for (int i = 0; i < limit; ++i) {
+                if (ready()) {
+                    if (limit < maxSpin) spinLimit.store(limit + limit / 8 + 1, std::memory_order_relaxed);
+                    return;
+                }
+                relax(i);
+            }
+            if (ready()) return;
+            spinLimit.store(limit / 2 > minSpin ? limit / 2 : minSpin, std::memory_order_relaxed);
+            std::unique_lock<std::mutex> lock(m_mutex);
+            sleepers.fetch_add(1);
+            m_condition.wait(lock, ready);
+            sleepers.fetch_sub(1);
+        }
+
+        // must be called after the state checked by the waiters' predicate is published
+        void wakeAll() {
+            if (sleepers.load() > 0) {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                m_condition.notify_all();
+            }
+        }
+
+    private:
+        static void relax(int iteration);
+
+        static const int maxSpin = 1 << 14;
+
+        int minSpin;
+        std::atomic<int> spinLimit;
+        std::atomic<int> sleepers;
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+    };
+
+    class BlockingBarrier : public Barrier {
+    public:
+        explicit BlockingBarrier(std::size_t nb_threads) : Barrier(nb_threads), currCounter(&counter[0]) {
+            counter[0] = m_threads;
+            counter[1] = 0;
+        }
+
+        void wait() override;
 
     private:
         std::mutex m_mutex;
         std::condition_variable m_condition;
-        const size_t m_threads;
         size_t counter[2], * currCounter;
     };
+
+    class SpinBarrier : public Barrier {
+    public:
+        explicit SpinBarrier(std::size_t nb_threads) : Barrier(nb_threads), arrived(0), generation(0), parker(nb_threads) { }
+
+        void wait() override;
+
+    private:
+        std::atomic<size_t> arrived;
+        std::atomic<size_t> generation;
+        Parker parker;
+    };
+
+    class DisseminationBarrier : public Barrier {
+    public:
+        explicit DisseminationBarrier(std::size_t nb_threads);
+
+        void wait() override;
+
+    private:
+        struct Node {
+            std::atomic<bool> flags[2][sizeof(size_t) * 8];
+            int parity = 0;
+            bool sense = true;
+            char padding[64];
+        };
+
+        size_t rounds = 0;
+        std::vector<std::unique_ptr<Node>> nodes;
+        Parker parker;
+    };
 }
 
 
@@ -2,7 +2,13 @@
 #define CITYFLOW_CONFIG_H
 
 namespace CityFlow {
-    const int MAX_NUM_CARS_ON_SEGMENT = 10;
+    // lane segments hold this many default vehicles unless segmentLength is configured
+    const int DEFAULT_NUM_CARS_ON_SEGMENT = 10;
+
+    // number of items handed out per steal in the parallel phases
+    const int DRIVABLE_CHUNK_SIZE = 8;
+    const int INTERSECTION_CHUNK_SIZE = 4;
+    const int VEHICLE_CHUNK_SIZE = 64;
 }
 
 #endif //CITYFLOW_CONFIG_H
@@ -0,0 +1,185 @@
+#include "utility/pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace CityFlow {
+
+    namespace {
+        const std::size_t CLASS_SIZE = 16;
+        const std::size_t CLASS_NUM = SmallObjectPool::MAX_SIZE / CLASS_SIZE;
+        const std::size_t CHUNK_SIZE = 256 * 1024;
+        const std::size_t BATCH_SIZE = 32;
+
+        struct FreeNode {
+            FreeNode *next;
+        };
+
+        struct FreeList {
+            FreeNode *head = nullptr;
+            std::size_t count = 0;
+
+            void push(FreeNode *node) {
+                node->next = head;
+                head = node;
+                ++count;
+            }
+
+            FreeNode *pop() {
+                FreeNode *node = head;
+                head = node->next;
+                --count;
+                return node;
+            }
+
+            // detaches up to n nodes from the front
+            FreeList split(std::size_t n) {
+                FreeList front;
+                while (front.count < n && head) front.push(pop());
+                return front;
+            }
+        };
+
+        struct ThreadCache;
+
+        struct Depot {
+            std::mutex mutex;
+            std::vector<FreeList> batches[CLASS_NUM];
+            std::vector<ThreadCache *> caches;
+            SmallObjectPool::Stats retired;
+        };
+
+        // never destroyed, thread caches may flush into it during exit
+        Depot &depot() {
+            static Depot *instance = new Depot;
+            return *instance;
+        }
+
+        // counters are written by the owning thread only and read by getStats()
+        struct Counter {
+            std::atomic<std::size_t> value{0};
+
+            void increment() { value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+
+            std::size_t get() const { return value.load(std::memory_order_relaxed); }
+        };
+
+        thread_local bool cacheDestroyed = false;
+
+        struct ThreadCache {
+            FreeList lists[CLASS_NUM];
+            Counter chunkAllocations, allocations, deallocations, largeAllocations, depotTransfers;
+
+            ThreadCache() {
+                Depot &shared = depot();
+                std::lock_guard<std::mutex> guard(shared.mutex);
+                shared.caches.push_back(this);
+            }
+
+            ~ThreadCache() {
+                Depot &shared = depot();
+                std::lock_guard<std::mutex> guard(shared.mutex);
+                for (std::size_t c = 0; c < CLASS_NUM; ++c)
+                    if (lists[c].count) shared.batches[c].push_back(lists[c]);
+                addTo(shared.retired);
+                shared.caches.erase(std::find(shared.caches.begin(), shared.caches.end(), this));
+                cacheDestroyed = true;
+            }
+
+            void addTo(SmallObjectPool::Stats &stats) const {
+                stats.chunkAllocations += chunkAllocations.get();
+                stats.allocations += allocations.get();
+                stats.deallocations += deallocations.get();
+                stats.largeAllocations += largeAllocations.get();
+                stats.depotTransfers += depotTransfers.get();
+            }
+
+            void refill(std::size_t c) {
+                Depot &shared = depot();
+                std::lock_guard<std::mutex> guard(shared.mutex);
+                depotTransfers.increment();
+                std::vector<FreeList> &batches = shared.batches[c];
+                if (batches.empty()) {
+                    // carve a new chunk into batches, keep one of them
+                    chunkAllocations.increment();
+                    std::size_t size = (c + 1) * CLASS_SIZE;
+                    char *chunk = static_cast<char *>(::operator new(CHUNK_SIZE));
+                    FreeList all;
+                    for (std::size_t offset = 0; offset + size <= CHUNK_SIZE; offset += size)
+                        all.push(reinterpret_cast<FreeNode *>(chunk + offset));
+                    while (all.count) batches.push_back(all.split(BATCH_SIZE));
+                }
+                lists[c] = batches.back();
+                batches.pop_back();
+            }
+
+            void release(std::size_t c) {
+                FreeList batch = lists[c].split(BATCH_SIZE);
+                Depot &shared = depot();
+                std::lock_guard<std::mutex> guard(shared.mutex);
+                depotTransfers.increment();
+                shared.batches[c].push_back(batch);
+            }
+        };
+
+        thread_local ThreadCache cache;
+
+        inline std::size_t sizeClass(std::size_t size) {
+            return size == 0 ? 0 : (size - 1) / CLASS_SIZE;
+        }
+    }
+
+    void *SmallObjectPool::allocate(std::size_t size) {
+        if (size > MAX_SIZE) {
+            if (!cacheDestroyed) cache.largeAllocations.increment();
+            return ::operator new(size);
+        }
+        std::size_t c = sizeClass(size);
+        if (cacheDestroyed) {
+            // only reached while a thread is exiting, hand out a node from the depot directly
+            Depot &shared = depot();
+            std::lock_guard<std::mutex> guard(shared.mutex);
+            for (FreeList &batch : shared.batches[c])
+                if (batch.count) return batch.pop();
+            return ::operator new((c + 1) * CLASS_SIZE);
+        }
+        ThreadCache &local = cache;
+        if (!local.lists[c].count) local.refill(c);
+        local.allocations.increment();
+        return local.lists[c].pop();
+    }
+
+    void SmallObjectPool::deallocate(void *pointer, std::size_t size) {
+        if (!pointer) return;
+        if (size > MAX_SIZE) {
+            ::operator delete(pointer);
+            return;
+        }
+        std::size_t c = sizeClass(size);
+        FreeNode *node = static_cast<FreeNode *>(pointer);
+        if (cacheDestroyed) {
+            Depot &shared = depot();
+            std::lock_guard<std::mutex> guard(shared.mutex);
+            FreeList batch;
+            batch.push(node);
+            shared.batches[c].push_back(batch);
+            return;
+        }
+        ThreadCache &local = cache;
+        local.deallocations.increment();
+        local.lists[c].push(node);
+        if (local.lists[c].count >= 2 * BATCH_SIZE) local.release(c);
+    }
+
+    SmallObjectPool::Stats SmallObjectPool::getStats() {
+        Depot &shared = depot();
+        std::lock_guard<std::mutex> guard(shared.mutex);
+        Stats stats = shared.retired;
+        for (const ThreadCache *local : shared.caches) local->addTo(stats);
+        return stats;
+    }
+}
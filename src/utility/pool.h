@@ -0,0 +1,54 @@
+#ifndef CITYFLOW_POOL_H
+#define CITYFLOW_POOL_H
+
+#include <cstddef>
+
+namespace CityFlow {
+
+    // Size-class allocator for the small objects that are created and dropped every step:
+    // vehicles, their lane-change state, signals and planned routes. Every thread keeps its
+    // own free lists and trades whole batches with a shared depot, so the common path takes
+    // no lock. Memory is carved from large chunks that are never returned to the system, it
+    // is reused by later objects of the same size class instead.
+    class SmallObjectPool {
+    public:
+        struct Stats {
+            std::size_t chunkAllocations = 0; // chunks requested from the system
+            std::size_t allocations = 0;      // objects handed out by the pool
+            std::size_t deallocations = 0;
+            std::size_t largeAllocations = 0; // requests above MAX_SIZE, passed on to operator new
+            std::size_t depotTransfers = 0;   // batches moved between a thread and the depot
+        };
+
+        static const std::size_t MAX_SIZE = 1024;
+
+        static void *allocate(std::size_t size);
+
+        static void deallocate(void *pointer, std::size_t size);
+
+        // counters of all threads, including the ones that have exited
+        static Stats getStats();
+    };
+
+    template <typename T>
+    struct PoolAllocator {
+        using value_type = T;
+
+        PoolAllocator() = default;
+
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U> &) {}
+
+        T *allocate(std::size_t n) { return static_cast<T *>(SmallObjectPool::allocate(n * sizeof(T))); }
+
+        void deallocate(T *pointer, std::size_t n) { SmallObjectPool::deallocate(pointer, n * sizeof(T)); }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+
+    template <typename T, typename U>
+    bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+}
+
+#endif //CITYFLOW_POOL_H
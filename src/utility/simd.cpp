@@ -0,0 +1,51 @@
+#include "utility/simd.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace CityFlow {
+
+    namespace {
+        SimdLevel detectSimdLevel() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+            if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+            if (__builtin_cpu_supports("sse4.2")) return SimdLevel::SSE42;
+#endif
+            return SimdLevel::GENERIC;
+        }
+
+        SimdLevel chooseSimdLevel() {
+            SimdLevel level = detectSimdLevel();
+            const char *cap = std::getenv("CITYFLOW_SIMD");
+            if (!cap || !*cap) return level;
+            for (SimdLevel candidate : {SimdLevel::GENERIC, SimdLevel::SSE42, SimdLevel::AVX2, SimdLevel::AVX512}) {
+                if (std::strcmp(cap, getSimdLevelName(candidate)) == 0)
+                    return candidate < level ? candidate : level;
+            }
+            std::cerr << "WARNING: unknown CITYFLOW_SIMD value " << cap << ", using "
+                      << getSimdLevelName(level) << std::endl;
+            return level;
+        }
+    }
+
+    SimdLevel getSimdLevel() {
+        static const SimdLevel level = chooseSimdLevel();
+        return level;
+    }
+
+    const char *getSimdLevelName(SimdLevel level) {
+        switch (level) {
+            case SimdLevel::SSE42:
+                return "sse4.2";
+            case SimdLevel::AVX2:
+                return "avx2";
+            case SimdLevel::AVX512:
+                return "avx512";
+            default:
+                return "generic";
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef CITYFLOW_SIMD_H
+#define CITYFLOW_SIMD_H
+
+// Scalar hot spots are compiled once per instruction set, the loader picks the clone for
+// the running cpu. Without ifunc support they are built for the baseline only.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__linux__) && \
+    (!defined(__clang__) || __clang_major__ >= 14)
+#define CITYFLOW_MULTIVERSION __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define CITYFLOW_MULTIVERSION
+#endif
+
+namespace CityFlow {
+
+    enum class SimdLevel { GENERIC, SSE42, AVX2, AVX512 };
+
+    // Widest instruction set of this cpu that the car-following kernels are built for, detected
+    // on first use. The CITYFLOW_SIMD environment variable ("generic", "sse4.2", "avx2", "avx512")
+    // can lower it, e.g. to reproduce results of an older node. CITYFLOW_MULTIVERSION clones
+    // are picked by the loader from the cpu alone and ignore it.
+    SimdLevel getSimdLevel();
+
+    const char *getSimdLevelName(SimdLevel level);
+}
+
+#endif //CITYFLOW_SIMD_H
@@ -113,6 +113,33 @@ namespace CityFlow {
         return true;
     }
 
+    bool readTextFromFile(const std::string &filename, std::string &text) {
+        FILE *fp = fopen(filename.c_str(), "r");
+        if (!fp) {
+            return false;
+        }
+        char readBuffer[JSON_BUFFER_SIZE];
+        text.clear();
+        size_t count;
+        while ((count = fread(readBuffer, 1, sizeof(readBuffer), fp)) > 0)
+            text.append(readBuffer, count);
+        fclose(fp);
+        return true;
+    }
+
+    bool readJsonFromString(const std::string &text, rapidjson::Document &document) {
+        rapidjson::StringStream is(text.c_str());
+        rapidjson::CursorStreamWrapper<rapidjson::StringStream> csw(is);
+        document.ParseStream(csw);
+        if (document.HasParseError()) {
+            std::cerr << "Json parsing error at line " << csw.GetLine() << std::endl;
+            std::cerr << rapidjson::GetParseError_En(document.GetParseError());
+            std::cerr << std::endl;
+            throw JsonFormatError("Json parsing error");
+        }
+        return true;
+    }
+
     bool writeJsonToFile(const std::string &filename, const rapidjson::Document &document) {
         FILE *fp = fopen(filename.c_str(), "w");
         if (!fp) {
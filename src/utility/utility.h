@@ -81,6 +81,8 @@ namespace CityFlow {
     std::vector<int> generateRandomIndices(size_t n, std::mt19937 *rnd); // size_t compile error
 
     bool readJsonFromFile(const std::string &filename, rapidjson::Document &document);
+    bool readTextFromFile(const std::string &filename, std::string &text);
+    bool readJsonFromString(const std::string &text, rapidjson::Document &document);
     bool writeJsonToFile(const std::string &filename, const rapidjson::Document &document);
 
     class JsonFormatError: public std::runtime_error {
@@ -0,0 +1,61 @@
+#include "utility/workstealing.h"
+
+#include <cassert>
+
+namespace CityFlow {
+
+    static inline uint64_t packBounds(uint64_t begin, uint64_t end) { return begin | (end << 32); }
+
+    WorkStealingQueue::WorkStealingQueue(std::size_t threadNum, std::size_t chunkSize)
+        : threadNum(threadNum), chunkSize(chunkSize), slots(new Slot[threadNum]) {
+        assert(chunkSize > 0);
+        for (std::size_t i = 0; i < threadNum; ++i)
+            slots[i].bounds.store(0, std::memory_order_relaxed);
+    }
+
+    void WorkStealingQueue::publish(std::size_t thread, std::size_t size) {
+        Slot &slot = slots[thread];
+        slot.size = size;
+        slot.bounds.store(packBounds(0, (size + chunkSize - 1) / chunkSize), std::memory_order_release);
+    }
+
+    bool WorkStealingQueue::takeFront(std::size_t thread, std::size_t &chunk) {
+        std::atomic<uint64_t> &bounds = slots[thread].bounds;
+        uint64_t current = bounds.load(std::memory_order_acquire);
+        while (true) {
+            uint64_t begin = current & 0xffffffffu, end = current >> 32;
+            if (begin >= end) return false;
+            if (bounds.compare_exchange_weak(current, packBounds(begin + 1, end), std::memory_order_acq_rel)) {
+                chunk = begin;
+                return true;
+            }
+        }
+    }
+
+    bool WorkStealingQueue::takeBack(std::size_t thread, std::size_t &chunk) {
+        std::atomic<uint64_t> &bounds = slots[thread].bounds;
+        uint64_t current = bounds.load(std::memory_order_acquire);
+        while (true) {
+            uint64_t begin = current & 0xffffffffu, end = current >> 32;
+            if (begin >= end) return false;
+            if (bounds.compare_exchange_weak(current, packBounds(begin, end - 1), std::memory_order_acq_rel)) {
+                chunk = end - 1;
+                return true;
+            }
+        }
+    }
+
+    bool WorkStealingQueue::next(std::size_t thread, std::size_t &victim, std::size_t &begin, std::size_t &end) {
+        std::size_t chunk;
+        for (std::size_t k = 0; k < threadNum; ++k) {
+            std::size_t candidate = (thread + k) % threadNum;
+            if (k == 0 ? takeFront(candidate, chunk) : takeBack(candidate, chunk)) {
+                victim = candidate;
+                begin = chunk * chunkSize;
+                end = begin + chunkSize < slots[candidate].size ? begin + chunkSize : slots[candidate].size;
+                return true;
+            }
+        }
+        return false;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef CITYFLOW_WORKSTEALING_H
+#define CITYFLOW_WORKSTEALING_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace CityFlow {
+
+    // Every thread publishes its own items as a range of fixed-size chunks. The owner takes
+    // chunks from the front of its range, a thread that runs out steals from the back of
+    // the others' ranges. Both ends live in one 64-bit word, so taking a chunk is a single CAS.
+    // Ranges are only refilled between two barriers, once all of them have been drained.
+    class WorkStealingQueue {
+    public:
+        WorkStealingQueue(std::size_t threadNum, std::size_t chunkSize);
+
+        template <typename Item, typename Function>
+        void forEach(std::size_t thread, const std::vector<std::vector<Item>> &pools, Function f) {
+            publish(thread, pools[thread].size());
+            std::size_t victim, begin, end;
+            while (next(thread, victim, begin, end)) {
+                const std::vector<Item> &pool = pools[victim];
+                for (std::size_t i = begin; i < end; ++i) f(pool[i]);
+            }
+        }
+
+        void publish(std::size_t thread, std::size_t size);
+
+        bool next(std::size_t thread, std::size_t &victim, std::size_t &begin, std::size_t &end);
+
+    private:
+        struct Slot {
+            std::atomic<uint64_t> bounds;   // low 32 bits: first chunk, high 32 bits: end chunk
+            std::size_t size = 0;
+            char padding[64];
+        };
+
+        bool takeFront(std::size_t thread, std::size_t &chunk);
+
+        bool takeBack(std::size_t thread, std::size_t &chunk);
+
+        std::size_t threadNum;
+        std::size_t chunkSize;
+        std::unique_ptr<Slot[]> slots;
+    };
+}
+
+#endif //CITYFLOW_WORKSTEALING_H
@@ -0,0 +1,216 @@
+#include "vehicle/carfollow.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CITYFLOW_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace CityFlow {
+
+    namespace {
+        void computeScalar(const CarFollowBatch &batch, std::size_t begin, double interval) {
+            for (std::size_t i = begin; i < batch.size; ++i)
+                batch.followSpeed[i] = carFollowSpeed(batch.speed[i], batch.gap[i], batch.maxSpeed[i],
+                                                      batch.maxNegAcc[i], batch.usualNegAcc[i], batch.minGap[i],
+                                                      batch.headwayTime[i], batch.hasCustomSpeed[i] != 0,
+                                                      batch.customSpeed[i], batch.hasLeader[i] != 0,
+                                                      batch.leaderSpeed[i], batch.leaderMaxNegAcc[i],
+                                                      batch.leaderUsualNegAcc[i], interval);
+        }
+
+#ifdef CITYFLOW_X86_KERNELS
+        // The vector kernels evaluate every branch and blend the results, keeping the scalar
+        // operation order. The project is built without floating-point contraction.
+
+        __attribute__((target("sse4.2")))
+        inline __m128d noCollisionSpeed128(__m128d vL, __m128d dL, __m128d vF, __m128d dF, __m128d gap,
+                                           double interval, __m128d targetGap) {
+            const __m128d half = _mm_set1_pd(0.5), two = _mm_set1_pd(2), four = _mm_set1_pd(4);
+            const __m128d dt = _mm_set1_pd(interval);
+            double bScalar = 0.5 * interval;
+            __m128d b = _mm_set1_pd(bScalar), bb = _mm_set1_pd(bScalar * bScalar);
+            __m128d c = _mm_sub_pd(_mm_sub_pd(_mm_add_pd(_mm_div_pd(_mm_mul_pd(vF, dt), two), targetGap),
+                                              _mm_div_pd(_mm_mul_pd(_mm_mul_pd(half, vL), vL), dL)),
+                                   gap);
+            __m128d a = _mm_div_pd(half, dF);
+            __m128d fourAC = _mm_mul_pd(_mm_mul_pd(four, a), c);
+            __m128d v1 = _mm_mul_pd(_mm_div_pd(half, a), _mm_sub_pd(_mm_sqrt_pd(_mm_sub_pd(bb, fourAC)), b));
+            __m128d v2 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(two, vL), _mm_mul_pd(dL, dt)),
+                                    _mm_div_pd(_mm_mul_pd(two, _mm_sub_pd(gap, targetGap)), dt));
+            __m128d collide = _mm_cmplt_pd(bb, fourAC);
+            return _mm_blendv_pd(_mm_min_pd(v1, v2), _mm_set1_pd(-100), collide);
+        }
+
+        __attribute__((target("sse4.2")))
+        void computeSSE42(const CarFollowBatch &batch, double interval) {
+            const __m128d zero = _mm_setzero_pd(), two = _mm_set1_pd(2), dt = _mm_set1_pd(interval);
+            const __m128d halfInterval = _mm_set1_pd(interval / 2);
+            std::size_t i = 0;
+            for (; i + 2 <= batch.size; i += 2) {
+                __m128d speed = _mm_loadu_pd(batch.speed + i);
+                __m128d gap = _mm_loadu_pd(batch.gap + i);
+                __m128d leaderSpeed = _mm_loadu_pd(batch.leaderSpeed + i);
+                __m128d customSpeed = _mm_loadu_pd(batch.customSpeed + i);
+                __m128d hasLeader = _mm_cmpneq_pd(_mm_loadu_pd(batch.hasLeader + i), zero);
+                __m128d hasCustom = _mm_cmpneq_pd(_mm_loadu_pd(batch.hasCustomSpeed + i), zero);
+
+                __m128d v = noCollisionSpeed128(leaderSpeed, _mm_loadu_pd(batch.leaderMaxNegAcc + i), speed,
+                                                _mm_loadu_pd(batch.maxNegAcc + i), gap, interval, zero);
+                __m128d customFollow = _mm_min_pd(customSpeed, v);
+
+                __m128d assumeDecel = _mm_blendv_pd(zero, _mm_sub_pd(speed, leaderSpeed),
+                                                    _mm_cmpgt_pd(speed, leaderSpeed));
+                __m128d usual = noCollisionSpeed128(leaderSpeed, _mm_loadu_pd(batch.leaderUsualNegAcc + i), speed,
+                                                    _mm_loadu_pd(batch.usualNegAcc + i), gap, interval,
+                                                    _mm_loadu_pd(batch.minGap + i));
+                __m128d headway = _mm_div_pd(
+                        _mm_sub_pd(_mm_add_pd(gap, _mm_mul_pd(_mm_add_pd(leaderSpeed, _mm_div_pd(assumeDecel, two)), dt)),
+                                   _mm_div_pd(_mm_mul_pd(speed, dt), two)),
+                        _mm_add_pd(_mm_loadu_pd(batch.headwayTime + i), halfInterval));
+                __m128d follow = _mm_min_pd(_mm_min_pd(v, usual), headway);
+
+                __m128d free = _mm_blendv_pd(_mm_loadu_pd(batch.maxSpeed + i), customSpeed, hasCustom);
+                follow = _mm_blendv_pd(follow, customFollow, hasCustom);
+                _mm_storeu_pd(batch.followSpeed + i, _mm_blendv_pd(free, follow, hasLeader));
+            }
+            computeScalar(batch, i, interval);
+        }
+
+        __attribute__((target("avx2")))
+        inline __m256d noCollisionSpeed256(__m256d vL, __m256d dL, __m256d vF, __m256d dF, __m256d gap,
+                                           double interval, __m256d targetGap) {
+            const __m256d half = _mm256_set1_pd(0.5), two = _mm256_set1_pd(2), four = _mm256_set1_pd(4);
+            const __m256d dt = _mm256_set1_pd(interval);
+            double bScalar = 0.5 * interval;
+            __m256d b = _mm256_set1_pd(bScalar), bb = _mm256_set1_pd(bScalar * bScalar);
+            __m256d c = _mm256_sub_pd(_mm256_sub_pd(_mm256_add_pd(_mm256_div_pd(_mm256_mul_pd(vF, dt), two), targetGap),
+                                                    _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(half, vL), vL), dL)),
+                                      gap);
+            __m256d a = _mm256_div_pd(half, dF);
+            __m256d fourAC = _mm256_mul_pd(_mm256_mul_pd(four, a), c);
+            __m256d v1 = _mm256_mul_pd(_mm256_div_pd(half, a), _mm256_sub_pd(_mm256_sqrt_pd(_mm256_sub_pd(bb, fourAC)), b));
+            __m256d v2 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(two, vL), _mm256_mul_pd(dL, dt)),
+                                       _mm256_div_pd(_mm256_mul_pd(two, _mm256_sub_pd(gap, targetGap)), dt));
+            __m256d collide = _mm256_cmp_pd(bb, fourAC, _CMP_LT_OQ);
+            return _mm256_blendv_pd(_mm256_min_pd(v1, v2), _mm256_set1_pd(-100), collide);
+        }
+
+        __attribute__((target("avx2")))
+        void computeAVX2(const CarFollowBatch &batch, double interval) {
+            const __m256d zero = _mm256_setzero_pd(), two = _mm256_set1_pd(2), dt = _mm256_set1_pd(interval);
+            const __m256d halfInterval = _mm256_set1_pd(interval / 2);
+            std::size_t i = 0;
+            for (; i + 4 <= batch.size; i += 4) {
+                __m256d speed = _mm256_loadu_pd(batch.speed + i);
+                __m256d gap = _mm256_loadu_pd(batch.gap + i);
+                __m256d leaderSpeed = _mm256_loadu_pd(batch.leaderSpeed + i);
+                __m256d customSpeed = _mm256_loadu_pd(batch.customSpeed + i);
+                __m256d hasLeader = _mm256_cmp_pd(_mm256_loadu_pd(batch.hasLeader + i), zero, _CMP_NEQ_OQ);
+                __m256d hasCustom = _mm256_cmp_pd(_mm256_loadu_pd(batch.hasCustomSpeed + i), zero, _CMP_NEQ_OQ);
+
+                __m256d v = noCollisionSpeed256(leaderSpeed, _mm256_loadu_pd(batch.leaderMaxNegAcc + i), speed,
+                                                _mm256_loadu_pd(batch.maxNegAcc + i), gap, interval, zero);
+                __m256d customFollow = _mm256_min_pd(customSpeed, v);
+
+                __m256d assumeDecel = _mm256_blendv_pd(zero, _mm256_sub_pd(speed, leaderSpeed),
+                                                       _mm256_cmp_pd(speed, leaderSpeed, _CMP_GT_OQ));
+                __m256d usual = noCollisionSpeed256(leaderSpeed, _mm256_loadu_pd(batch.leaderUsualNegAcc + i), speed,
+                                                    _mm256_loadu_pd(batch.usualNegAcc + i), gap, interval,
+                                                    _mm256_loadu_pd(batch.minGap + i));
+                __m256d headway = _mm256_div_pd(
+                        _mm256_sub_pd(_mm256_add_pd(gap, _mm256_mul_pd(_mm256_add_pd(leaderSpeed,
+                                                                                     _mm256_div_pd(assumeDecel, two)), dt)),
+                                      _mm256_div_pd(_mm256_mul_pd(speed, dt), two)),
+                        _mm256_add_pd(_mm256_loadu_pd(batch.headwayTime + i), halfInterval));
+                __m256d follow = _mm256_min_pd(_mm256_min_pd(v, usual), headway);
+
+                __m256d free = _mm256_blendv_pd(_mm256_loadu_pd(batch.maxSpeed + i), customSpeed, hasCustom);
+                follow = _mm256_blendv_pd(follow, customFollow, hasCustom);
+                _mm256_storeu_pd(batch.followSpeed + i, _mm256_blendv_pd(free, follow, hasLeader));
+            }
+            computeScalar(batch, i, interval);
+        }
+
+#if defined(__GNUC__) && !defined(__clang__)
+        // the AVX-512 intrinsics of gcc start from an undefined vector, which -Wall reports
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+        __attribute__((target("avx512f")))
+        inline __m512d noCollisionSpeed512(__m512d vL, __m512d dL, __m512d vF, __m512d dF, __m512d gap,
+                                           double interval, __m512d targetGap) {
+            const __m512d half = _mm512_set1_pd(0.5), two = _mm512_set1_pd(2), four = _mm512_set1_pd(4);
+            const __m512d dt = _mm512_set1_pd(interval);
+            double bScalar = 0.5 * interval;
+            __m512d b = _mm512_set1_pd(bScalar), bb = _mm512_set1_pd(bScalar * bScalar);
+            __m512d c = _mm512_sub_pd(_mm512_sub_pd(_mm512_add_pd(_mm512_div_pd(_mm512_mul_pd(vF, dt), two), targetGap),
+                                                    _mm512_div_pd(_mm512_mul_pd(_mm512_mul_pd(half, vL), vL), dL)),
+                                      gap);
+            __m512d a = _mm512_div_pd(half, dF);
+            __m512d fourAC = _mm512_mul_pd(_mm512_mul_pd(four, a), c);
+            __m512d v1 = _mm512_mul_pd(_mm512_div_pd(half, a), _mm512_sub_pd(_mm512_sqrt_pd(_mm512_sub_pd(bb, fourAC)), b));
+            __m512d v2 = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(two, vL), _mm512_mul_pd(dL, dt)),
+                                       _mm512_div_pd(_mm512_mul_pd(two, _mm512_sub_pd(gap, targetGap)), dt));
+            __mmask8 collide = _mm512_cmp_pd_mask(bb, fourAC, _CMP_LT_OQ);
+            return _mm512_mask_blend_pd(collide, _mm512_min_pd(v1, v2), _mm512_set1_pd(-100));
+        }
+
+        __attribute__((target("avx512f")))
+        void computeAVX512(const CarFollowBatch &batch, double interval) {
+            const __m512d zero = _mm512_setzero_pd(), two = _mm512_set1_pd(2), dt = _mm512_set1_pd(interval);
+            const __m512d halfInterval = _mm512_set1_pd(interval / 2);
+            std::size_t i = 0;
+            for (; i + 8 <= batch.size; i += 8) {
+                __m512d speed = _mm512_loadu_pd(batch.speed + i);
+                __m512d gap = _mm512_loadu_pd(batch.gap + i);
+                __m512d leaderSpeed = _mm512_loadu_pd(batch.leaderSpeed + i);
+                __m512d customSpeed = _mm512_loadu_pd(batch.customSpeed + i);
+                __mmask8 hasLeader = _mm512_cmp_pd_mask(_mm512_loadu_pd(batch.hasLeader + i), zero, _CMP_NEQ_OQ);
+                __mmask8 hasCustom = _mm512_cmp_pd_mask(_mm512_loadu_pd(batch.hasCustomSpeed + i), zero, _CMP_NEQ_OQ);
+
+                __m512d v = noCollisionSpeed512(leaderSpeed, _mm512_loadu_pd(batch.leaderMaxNegAcc + i), speed,
+                                                _mm512_loadu_pd(batch.maxNegAcc + i), gap, interval, zero);
+                __m512d customFollow = _mm512_min_pd(customSpeed, v);
+
+                __m512d assumeDecel = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(speed, leaderSpeed, _CMP_GT_OQ),
+                                                           zero, _mm512_sub_pd(speed, leaderSpeed));
+                __m512d usual = noCollisionSpeed512(leaderSpeed, _mm512_loadu_pd(batch.leaderUsualNegAcc + i), speed,
+                                                    _mm512_loadu_pd(batch.usualNegAcc + i), gap, interval,
+                                                    _mm512_loadu_pd(batch.minGap + i));
+                __m512d headway = _mm512_div_pd(
+                        _mm512_sub_pd(_mm512_add_pd(gap, _mm512_mul_pd(_mm512_add_pd(leaderSpeed,
+                                                                                     _mm512_div_pd(assumeDecel, two)), dt)),
+                                      _mm512_div_pd(_mm512_mul_pd(speed, dt), two)),
+                        _mm512_add_pd(_mm512_loadu_pd(batch.headwayTime + i), halfInterval));
+                __m512d follow = _mm512_min_pd(_mm512_min_pd(v, usual), headway);
+
+                __m512d free = _mm512_mask_blend_pd(hasCustom, _mm512_loadu_pd(batch.maxSpeed + i), customSpeed);
+                follow = _mm512_mask_blend_pd(hasCustom, follow, customFollow);
+                _mm512_storeu_pd(batch.followSpeed + i, _mm512_mask_blend_pd(hasLeader, free, follow));
+            }
+            computeScalar(batch, i, interval);
+        }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+    }
+
+    void computeCarFollowSpeed(const CarFollowBatch &batch, double interval, SimdLevel level) {
+        switch (level) {
+#ifdef CITYFLOW_X86_KERNELS
+            case SimdLevel::SSE42:
+                computeSSE42(batch, interval);
+                return;
+            case SimdLevel::AVX2:
+                computeAVX2(batch, interval);
+                return;
+            case SimdLevel::AVX512:
+                computeAVX512(batch, interval);
+                return;
+#endif
+            default:
+                computeScalar(batch, 0, interval);
+        }
+    }
+}
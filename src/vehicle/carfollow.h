@@ -0,0 +1,65 @@
+#ifndef CITYFLOW_CARFOLLOW_H
+#define CITYFLOW_CARFOLLOW_H
+
+#include "utility/simd.h"
+
+#include <cmath>
+#include <cstddef>
+
+namespace CityFlow {
+
+    // Highest speed from which the follower can still stop behind a leader braking at dL,
+    // keeping targetGap. Returns -100 when a collision cannot be avoided.
+    inline double noCollisionSpeed(double vL, double dL, double vF, double dF, double gap, double interval,
+                                   double targetGap) {
+        double c = vF * interval / 2 + targetGap - 0.5 * vL * vL / dL - gap;
+        double a = 0.5 / dF;
+        double b = 0.5 * interval;
+        if (b * b < 4 * a * c) return -100;
+        double v1 = 0.5 / a * (std::sqrt(b * b - 4 * a * c) - b);
+        double v2 = 2 * vL - dL * interval + 2 * (gap - targetGap) / interval;
+        return v1 < v2 ? v1 : v2;
+    }
+
+    // The car-following model of one follower, used by Vehicle and by the scalar kernel.
+    // When there is no leader the leader fields are ignored.
+    inline double carFollowSpeed(double speed, double gap, double maxSpeed, double maxNegAcc, double usualNegAcc,
+                                 double minGap, double headwayTime, bool hasCustomSpeed, double customSpeed,
+                                 bool hasLeader, double leaderSpeed, double leaderMaxNegAcc,
+                                 double leaderUsualNegAcc, double interval) {
+        if (!hasLeader) return hasCustomSpeed ? customSpeed : maxSpeed;
+
+        // collision free
+        double v = noCollisionSpeed(leaderSpeed, leaderMaxNegAcc, speed, maxNegAcc, gap, interval, 0);
+        if (hasCustomSpeed) return customSpeed < v ? customSpeed : v;
+
+        // safe distance, assuming the relative deceleration of a real driver
+        double assumeDecel = 0;
+        if (speed > leaderSpeed) assumeDecel = speed - leaderSpeed;
+        double usual = noCollisionSpeed(leaderSpeed, leaderUsualNegAcc, speed, usualNegAcc, gap, interval, minGap);
+        v = v < usual ? v : usual;
+        double headway = (gap + (leaderSpeed + assumeDecel / 2) * interval - speed * interval / 2) /
+                         (headwayTime + interval / 2);
+        return v < headway ? v : headway;
+    }
+
+    // Car-following inputs of a batch of followers, one array per field. Flags are 0 or 1.
+    // When a follower has no leader the leader fields are ignored, but must be finite.
+    struct CarFollowBatch {
+        std::size_t size;
+        const double *speed, *gap, *maxSpeed, *maxNegAcc, *usualNegAcc, *minGap, *headwayTime, *customSpeed;
+        const double *leaderSpeed, *leaderMaxNegAcc, *leaderUsualNegAcc;
+        const double *hasLeader, *hasCustomSpeed;
+        double *followSpeed;
+    };
+
+    // The vector kernels follow the scalar operation order without fused multiply-add, so they
+    // agree with the scalar kernel to the last bit on IEEE hardware. Callers comparing them
+    // should still allow this much absolute difference, in m/s.
+    const double CAR_FOLLOW_TOLERANCE = 1e-9;
+
+    // runs the kernel for the given instruction set, the caller makes sure the cpu supports it
+    void computeCarFollowSpeed(const CarFollowBatch &batch, double interval, SimdLevel level);
+}
+
+#endif //CITYFLOW_CARFOLLOW_H
@@ -10,7 +10,7 @@ namespace CityFlow{
           leaderGap(other.leaderGap), followerGap(other.followerGap), waitingTime(other.waitingTime),
           changing(other.changing), lastChangeTime(other.lastChangeTime) {
         if (other.signalSend) {
-            signalSend = std::make_shared<Signal>(*other.signalSend);
+            signalSend = std::allocate_shared<Signal>(PoolAllocator<Signal>(), *other.signalSend);
             signalSend->source = vehicle;
         }
     }
@@ -77,28 +77,16 @@ namespace CityFlow{
 
         assert(vehicle->getCurDrivable()->isLane());
         Lane *targetLane = signalSend->target;
-        int  segId = vehicle->getSegmentIndex();
-        auto targetSeg = targetLane->getSegment(segId);
-        auto followerItr = (vehicle->getListIterator());
-        followerItr++;
-
         shadow->setParent(vehicle);
         vehicle->setShadow(shadow);
         shadow->controllerInfo.blocker = nullptr;
         shadow->controllerInfo.drivable = targetLane;
         shadow->controllerInfo.router.update();
 
-        auto targetFollowerItr = targetFollower ?  targetFollower->getListIterator() : targetLane->getVehicles().end();
-
-        auto newItr = targetLane->getVehicles().insert(targetFollowerItr, shadow);
-
-        targetSeg->insertVehicle(newItr);
-
-        shadow->updateLeaderAndGap(targetLeader);
-        if (targetFollower)
-            targetFollower->updateLeaderAndGap(shadow);
-
+        targetLane->insertVehicle(shadow, vehicle->getSegmentIndex());
 
+        // leaders and gaps of the shadow and its follower are refreshed by the engine right after
+        // lane changes are scheduled; looking ahead here would read lanes of other roads
     }
 
     int LaneChange::getDirection() {
@@ -123,7 +111,8 @@ namespace CityFlow{
         partner->laneChangeInfo.offset = 0;
         partner->laneChangeInfo.partner = nullptr;
         vehicle->laneChangeInfo.partner = nullptr;
-        clearSignal();
+        // vehicles yielding to this one still read its target leader and follower in this
+        // stage, the engine clears the signal once the vehicle is retired
     }
 
     void LaneChange::clearSignal() {
@@ -151,7 +140,7 @@ namespace CityFlow{
     void SimpleLaneChange::makeSignal(double interval) {
         if (changing) return;
         if (vehicle->engine->getCurrentTime() - lastChangeTime < coolingTime) return;
-        signalSend = std::make_shared<Signal>();
+        signalSend = std::allocate_shared<Signal>(PoolAllocator<Signal>());
         signalSend->source = vehicle;
         if (vehicle->getCurDrivable()->isLane()) {
             Lane *curLane = (Lane *)vehicle->getCurDrivable();
@@ -2,6 +2,7 @@
 #define CITYFLOW_ROUTER
 
 #include "engine/archive.h"
+#include "utility/pool.h"
 
 #include <vector>
 #include <random>
@@ -25,7 +26,7 @@ namespace CityFlow {
         std::vector<Road *>::const_iterator iCurRoad;
         std::mt19937 *rnd = nullptr;
 
-        mutable std::deque<Drivable *> planned;
+        mutable std::deque<Drivable *, PoolAllocator<Drivable *>> planned;
         
         int selectLaneIndex(const Lane *curLane, const std::vector<Lane *> &lanes) const;
 
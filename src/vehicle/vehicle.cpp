@@ -1,5 +1,6 @@
 #include "vehicle/vehicle.h"
 #include "engine/engine.h"
+#include "vehicle/carfollow.h"
 
 #include <iostream>
 #include <limits>
@@ -20,24 +21,28 @@ namespace CityFlow {
         : vehicleInfo(vehicle.vehicleInfo), controllerInfo(this, vehicle.controllerInfo),
           laneChangeInfo(vehicle.laneChangeInfo), buffer(vehicle.buffer), priority(vehicle.priority),
           id(vehicle.id), engine(vehicle.engine),
-          laneChange(std::make_shared<SimpleLaneChange>(this, *vehicle.laneChange)),
+          laneChange(std::allocate_shared<SimpleLaneChange>(PoolAllocator<SimpleLaneChange>(), this, *vehicle.laneChange)),
           flow(flow){
         enterTime = vehicle.enterTime;
+        copyState(vehicle);
     }
 
     Vehicle::Vehicle(const Vehicle &vehicle, const std::string &id, Engine *engine, Flow *flow)
         : vehicleInfo(vehicle.vehicleInfo), controllerInfo(this, vehicle.controllerInfo),
           laneChangeInfo(vehicle.laneChangeInfo), buffer(vehicle.buffer), 
-          id(id), engine(engine), laneChange(std::make_shared<SimpleLaneChange>(this)),
+          priority(vehicle.priority), id(id), engine(engine),
+          laneChange(std::allocate_shared<SimpleLaneChange>(PoolAllocator<SimpleLaneChange>(), this)),
           flow(flow){
-        while (engine->checkPriority(priority = engine->rnd()));
+        // the caller draws a new priority, it may run outside the main thread
         controllerInfo.router.setVehicle(this);
         enterTime = vehicle.enterTime;
+        copyState(vehicle);
     }
 
     Vehicle::Vehicle(const VehicleInfo &vehicleInfo, const std::string &id, Engine *engine, Flow *flow)
         : vehicleInfo(vehicleInfo), controllerInfo(this, vehicleInfo.route, &(engine->rnd)),
-          id(id), engine(engine), laneChange(std::make_shared<SimpleLaneChange>(this)),
+          id(id), engine(engine),
+          laneChange(std::allocate_shared<SimpleLaneChange>(PoolAllocator<SimpleLaneChange>(), this)),
           flow(flow){
         controllerInfo.approachingIntersectionDistance =
             vehicleInfo.maxSpeed * vehicleInfo.maxSpeed / vehicleInfo.usualNegAcc / 2 +
@@ -46,12 +51,43 @@ namespace CityFlow {
         enterTime = engine->getCurrentTime();
     }
 
+    Vehicle::~Vehicle() {
+        if (state) state->release(slot);
+    }
+
+    void Vehicle::copyState(const Vehicle &vehicle) {
+        if (!vehicle.state) return;
+        vehicleInfo.speed = vehicle.getSpeed();
+        controllerInfo.dis = vehicle.getDistance();
+        controllerInfo.gap = vehicle.getGap();
+        controllerInfo.leader = vehicle.getLeader();
+        buffer.customSpeed = vehicle.state->customSpeed[vehicle.slot];
+        buffer.isCustomSpeedSet = vehicle.hasSetCustomSpeed();
+    }
+
+    void Vehicle::attach(VehicleStateStore &store) {
+        state = &store;
+        slot = store.allocate(this);
+        store.speed[slot] = vehicleInfo.speed;
+        store.dis[slot] = controllerInfo.dis;
+        store.gap[slot] = controllerInfo.gap;
+        store.customSpeed[slot] = buffer.isCustomSpeedSet ? buffer.customSpeed : 0;
+        store.hasCustomSpeed[slot] = buffer.isCustomSpeedSet ? 1 : 0;
+        store.maxSpeed[slot] = vehicleInfo.maxSpeed;
+        store.maxNegAcc[slot] = vehicleInfo.maxNegAcc;
+        store.usualNegAcc[slot] = vehicleInfo.usualNegAcc;
+        store.minGap[slot] = vehicleInfo.minGap;
+        store.headwayTime[slot] = vehicleInfo.headwayTime;
+        // a leader without a slot yet, as when an archive is resumed, is set again by the caller
+        setLeader(controllerInfo.leader);
+    }
+
     void Vehicle::setDeltaDistance(double dis) {
         if (!buffer.isDisSet || dis < buffer.deltaDis) {
             unSetEnd();
             unSetDrivable();
             buffer.deltaDis = dis;
-            dis = dis + controllerInfo.dis;
+            dis = dis + getDistance();
             Drivable *drivable = getCurDrivable();
             for (int i = 0; drivable && dis > drivable->getLength(); ++i) {
                 dis -= drivable->getLength();
@@ -80,20 +116,20 @@ namespace CityFlow {
 
     Point Vehicle::getPoint() const {
         if (fabs(laneChangeInfo.offset) < eps || !controllerInfo.drivable->isLane()) {
-            return controllerInfo.drivable->getPointByDistance(controllerInfo.dis);
+            return controllerInfo.drivable->getPointByDistance(getDistance());
         } else {
             assert(controllerInfo.drivable->isLane());
             const Lane *lane = static_cast<const Lane*>(controllerInfo.drivable);
-            Point origin = lane->getPointByDistance(controllerInfo.dis);
+            Point origin = lane->getPointByDistance(getDistance());
             Point next;
             double percentage;
             std::vector<Lane> &lans = lane->getBelongRoad()->getLanes();
             if (laneChangeInfo.offset > 0) {
-                next = lans[lane->getLaneIndex() + 1].getPointByDistance(controllerInfo.dis);
+                next = lans[lane->getLaneIndex() + 1].getPointByDistance(getDistance());
                 percentage = 2 * laneChangeInfo.offset / (lane->getWidth() +
                                                           lans[lane->getLaneIndex() + 1].getWidth());
             } else {
-                next = lans[lane->getLaneIndex() - 1].getPointByDistance(controllerInfo.dis);
+                next = lans[lane->getLaneIndex() - 1].getPointByDistance(getDistance());
                 percentage = -2 * laneChangeInfo.offset / (lane->getWidth() +
                                                            lans[lane->getLaneIndex() - 1].getWidth());
             }
@@ -110,16 +146,17 @@ namespace CityFlow {
             buffer.isEndSet = false;
         }
         if (buffer.isDisSet) {
-            controllerInfo.dis = buffer.dis;
+            (state ? state->dis[slot] : controllerInfo.dis) = buffer.dis;
             buffer.isDisSet = false;
         }
         if (buffer.isSpeedSet) {
-            vehicleInfo.speed = buffer.speed;
+            (state ? state->speed[slot] : vehicleInfo.speed) = buffer.speed;
             buffer.isSpeedSet = false;
         }
-        if (buffer.isCustomSpeedSet) {
+        if (state)
+            state->hasCustomSpeed[slot] = 0;
+        else
             buffer.isCustomSpeedSet = false;
-        }
         if (buffer.isDrivableSet) {
             controllerInfo.prevDrivable = controllerInfo.drivable;
             controllerInfo.drivable = buffer.drivable;
@@ -145,8 +182,8 @@ namespace CityFlow {
 
     std::pair<Point, Point> Vehicle::getCurPos() const {
         std::pair<Point, Point> ret;
-        ret.first = controllerInfo.drivable->getPointByDistance(controllerInfo.dis);
-        Point direction = controllerInfo.drivable->getDirectionByDistance(controllerInfo.dis);
+        ret.first = controllerInfo.drivable->getPointByDistance(getDistance());
+        Point direction = controllerInfo.drivable->getDirectionByDistance(getDistance());
         Point tail(ret.first);
         tail.x -= direction.x * vehicleInfo.len;
         tail.y -= direction.y * vehicleInfo.len;
@@ -155,114 +192,97 @@ namespace CityFlow {
     }
 
     void Vehicle::updateLeaderAndGap(Vehicle *leader) {
+        double &gap = state->gap[slot];
         if (leader != nullptr && leader->getCurDrivable() == getCurDrivable()) {
-            controllerInfo.leader = leader;
-            controllerInfo.gap = leader->getDistance() - leader->getLen() - controllerInfo.dis;
+            gap = leader->getDistance() - leader->getLen() - getDistance();
         } else {
-            controllerInfo.leader = nullptr;
-            Drivable *drivable = nullptr;
-            Vehicle *candidateLeader = nullptr;
-            double candidateGap = 0;
-            double dis = controllerInfo.drivable->getLength() - controllerInfo.dis;
-            for (int i = 0; ; ++i) {
-                drivable = getNextDrivable(i);
-                if (drivable == nullptr) return;
-                if (drivable->isLaneLink()) { // if laneLink, check all laneLink start from previous lane, because lanelinks may overlap 
-                    for (auto laneLink : static_cast<LaneLink *>(drivable)->getStartLane()->getLaneLinks()) {
-                        if ((candidateLeader = laneLink->getLastVehicle()) != nullptr) {
-                            candidateGap = dis + candidateLeader->getDistance() - candidateLeader->getLen();
-                            if (controllerInfo.leader == nullptr || candidateGap < controllerInfo.gap) {
-                                controllerInfo.leader = candidateLeader;
-                                controllerInfo.gap = candidateGap;
-                            }
+            leader = findLeaderAhead(gap);
+        }
+        setLeader(leader);
+    }
+
+    Vehicle *Vehicle::findLeaderAhead(double &gap) {
+        Vehicle *leader = nullptr;
+        Drivable *drivable = nullptr;
+        Vehicle *candidateLeader = nullptr;
+        double candidateGap = 0;
+        double dis = controllerInfo.drivable->getLength() - getDistance();
+        for (int i = 0; ; ++i) {
+            drivable = getNextDrivable(i);
+            if (drivable == nullptr) return nullptr;
+            if (drivable->isLaneLink()) { // if laneLink, check all laneLink start from previous lane, because lanelinks may overlap 
+                for (auto laneLink : static_cast<LaneLink *>(drivable)->getStartLane()->getLaneLinks()) {
+                    if ((candidateLeader = laneLink->getLastVehicle()) != nullptr) {
+                        candidateGap = dis + candidateLeader->getDistance() - candidateLeader->getLen();
+                        if (leader == nullptr || candidateGap < gap) {
+                            leader = candidateLeader;
+                            gap = candidateGap;
                         }
                     }
-                    if (controllerInfo.leader) return;
-                } else {
-                    if ((controllerInfo.leader = drivable->getLastVehicle()) != nullptr) {
-                        controllerInfo.gap =
-                                dis + controllerInfo.leader->getDistance() - controllerInfo.leader->getLen();
-                        return;
-                    }
                 }
-
-                dis += drivable->getLength();
-                if (dis > vehicleInfo.maxSpeed * vehicleInfo.maxSpeed / vehicleInfo.usualNegAcc / 2 +
-                          vehicleInfo.maxSpeed * engine->getInterval() * 2)
-                    return;
+                if (leader) return leader;
+            } else {
+                if ((leader = drivable->getLastVehicle()) != nullptr) {
+                    gap = dis + leader->getDistance() - leader->getLen();
+                    return leader;
+                }
             }
-            return;
+
+            dis += drivable->getLength();
+            if (dis > vehicleInfo.maxSpeed * vehicleInfo.maxSpeed / vehicleInfo.usualNegAcc / 2 +
+                      vehicleInfo.maxSpeed * engine->getInterval() * 2)
+                return nullptr;
         }
     }
 
-
+    void Vehicle::setLeader(Vehicle *leader) {
+        state->leader[slot] = leader && leader->state == state ? leader->slot : VehicleStateStore::NO_LEADER;
+    }
 
     double Vehicle::getNoCollisionSpeed(double vL, double dL, double vF, double dF, double gap, double interval,
-                                        double targetGap) const {
-        double c = vF * interval / 2 + targetGap - 0.5 * vL * vL / dL - gap;
-        double a = 0.5 / dF;
-        double b = 0.5 * interval;
-        if (b * b < 4 * a * c) return -100;
-        double v1 = 0.5 / a * (sqrt(b * b - 4 * a * c) - b);
-        double v2 = 2 * vL - dL * interval + 2 * (gap - targetGap) / interval;
-        return min2double(v1, v2);
+                                        double targetGap) {
+        return noCollisionSpeed(vL, dL, vF, dF, gap, interval, targetGap);
     }
 
     // should be move to seperate CarFollowing (Controller?) class later?
     double Vehicle::getCarFollowSpeed(double interval) {
+        // computed over the whole store by the engine for this step
+        if (!engine->isScalarCarFollow()) return state->followSpeed[slot];
         Vehicle *leader = getLeader();
-        if (leader == nullptr) return hasSetCustomSpeed() ? buffer.customSpeed : vehicleInfo.maxSpeed;
-
-        // collision free
-        double v = getNoCollisionSpeed(leader->getSpeed(), leader->getMaxNegAcc(), vehicleInfo.speed,
-                                       vehicleInfo.maxNegAcc, controllerInfo.gap, interval, 0);
-
-        if (hasSetCustomSpeed())
-            return min2double(buffer.customSpeed, v);
-
-        // safe distance
-        // get relative decel (mimic real scenario)
-        double assumeDecel = 0, leaderSpeed = leader->getSpeed();
-        if (vehicleInfo.speed > leaderSpeed) {
-            assumeDecel = vehicleInfo.speed - leaderSpeed;
-        }
-        v = min2double(v, getNoCollisionSpeed(leader->getSpeed(), leader->getUsualNegAcc(), vehicleInfo.speed,
-                                              vehicleInfo.usualNegAcc, controllerInfo.gap, interval,
-                                              vehicleInfo.minGap
-                                              ));
-        v = min2double(v,
-                       (controllerInfo.gap + (leaderSpeed + assumeDecel / 2) * interval -
-                        vehicleInfo.speed * interval / 2) / (vehicleInfo.headwayTime + interval / 2));
-
-        return v;
+        return carFollowSpeed(getSpeed(), getGap(), vehicleInfo.maxSpeed, vehicleInfo.maxNegAcc,
+                              vehicleInfo.usualNegAcc, vehicleInfo.minGap, vehicleInfo.headwayTime,
+                              hasSetCustomSpeed(), hasSetCustomSpeed() ? state->customSpeed[slot] : 0, leader != nullptr,
+                              leader ? leader->getSpeed() : 0, leader ? leader->getMaxNegAcc() : 1,
+                              leader ? leader->getUsualNegAcc() : 1, interval);
     }
 
     double Vehicle::getStopBeforeSpeed(double distance, double interval) const {
         assert(distance >= 0);
         if (getBrakeDistanceAfterAccel(vehicleInfo.usualPosAcc, vehicleInfo.usualNegAcc, interval) < distance)
-            return vehicleInfo.speed + vehicleInfo.usualPosAcc * interval;
-        double takeInterval = 2 * distance / (vehicleInfo.speed + eps) / interval;
+            return getSpeed() + vehicleInfo.usualPosAcc * interval;
+        double takeInterval = 2 * distance / (getSpeed() + eps) / interval;
         if (takeInterval >= 1) {
-            return vehicleInfo.speed - vehicleInfo.speed / (int) takeInterval;
+            return getSpeed() - getSpeed() / (int) takeInterval;
         } else {
-            return vehicleInfo.speed - vehicleInfo.speed / takeInterval;
+            return getSpeed() - getSpeed() / takeInterval;
         }
     }
 
+    CITYFLOW_MULTIVERSION
     int Vehicle::getReachSteps(double distance, double targetSpeed, double acc) const {
         if (distance <= 0) {
             return 0;
         }
-        if (vehicleInfo.speed > targetSpeed) {
-            return std::ceil(distance / vehicleInfo.speed);
+        if (getSpeed() > targetSpeed) {
+            return std::ceil(distance / getSpeed());
         }
         double distanceUntilTargetSpeed = getDistanceUntilSpeed(targetSpeed, acc);
         double interval = engine->getInterval();
         if (distanceUntilTargetSpeed > distance) {
             return std::ceil((std::sqrt(
-                    vehicleInfo.speed * vehicleInfo.speed + 2 * acc * distance) - vehicleInfo.speed) / acc / interval);
+                    getSpeed() * getSpeed() + 2 * acc * distance) - getSpeed()) / acc / interval);
         } else {
-            return std::ceil((targetSpeed - vehicleInfo.speed) / acc / interval) + std::ceil(
+            return std::ceil((targetSpeed - getSpeed()) / acc / interval) + std::ceil(
                     (distance - distanceUntilTargetSpeed) / targetSpeed / interval);
         }
     }
@@ -273,11 +293,11 @@ namespace CityFlow {
     }
 
     double Vehicle::getDistanceUntilSpeed(double speed, double acc) const {
-        if (speed <= vehicleInfo.speed) return 0;
+        if (speed <= getSpeed()) return 0;
         double interval = engine->getInterval();
-        int stage1steps = std::floor((speed - vehicleInfo.speed) / acc / interval);
-        double stage1speed = vehicleInfo.speed + stage1steps * acc / interval;
-        double stage1dis = (vehicleInfo.speed + stage1speed) * (stage1steps * interval) / 2;
+        int stage1steps = std::floor((speed - getSpeed()) / acc / interval);
+        double stage1speed = getSpeed() + stage1steps * acc / interval;
+        double stage1dis = (getSpeed() + stage1speed) * (stage1steps * interval) / 2;
         return stage1dis + (stage1speed < speed ? ((stage1speed + speed) * interval / 2) : 0);
     }
 
@@ -291,7 +311,7 @@ namespace CityFlow {
             return true;
         if (controllerInfo.drivable->isLane()) {
             Drivable *drivable = getNextDrivable();
-            if (drivable && drivable->isLaneLink() && controllerInfo.drivable->getLength() - controllerInfo.dis <=
+            if (drivable && drivable->isLaneLink() && controllerInfo.drivable->getLength() - getDistance() <=
                                                       controllerInfo.approachingIntersectionDistance) {
                 return true;
             }
@@ -300,7 +320,7 @@ namespace CityFlow {
     }
 
     double Vehicle::getBrakeDistanceAfterAccel(double acc, double dec, double interval) const {
-        double currentSpeed = vehicleInfo.speed;
+        double currentSpeed = getSpeed();
         double nextSpeed = currentSpeed + acc * interval;
         return (currentSpeed + nextSpeed) * interval / 2 + (nextSpeed * nextSpeed / dec / 2);
     }
@@ -309,7 +329,7 @@ namespace CityFlow {
         ControlInfo controlInfo;
         Drivable *drivable = controllerInfo.drivable;
         double v = vehicleInfo.maxSpeed;
-        v = min2double(v, vehicleInfo.speed + vehicleInfo.maxPosAcc * interval); // TODO: random???
+        v = min2double(v, getSpeed() + vehicleInfo.maxPosAcc * interval); // TODO: random???
 
         v = min2double(v, drivable->getMaxSpeed());
 
@@ -328,7 +348,7 @@ namespace CityFlow {
             }
         }
 
-        v = max2double(v, vehicleInfo.speed - vehicleInfo.maxNegAcc * interval);
+        v = max2double(v, getSpeed() - vehicleInfo.maxNegAcc * interval);
         controlInfo.speed = v;
 
         return controlInfo;
@@ -342,10 +362,10 @@ namespace CityFlow {
             laneLink = (LaneLink *) nextDrivable;
             if (!laneLink->isAvailable() || !laneLink->getEndLane()->canEnter(
                     this)) { // not only the first vehicle should follow intersection logic
-                if (getMinBrakeDistance() > controllerInfo.drivable->getLength() - controllerInfo.dis) {
+                if (getMinBrakeDistance() > controllerInfo.drivable->getLength() - getDistance()) {
                     // TODO: what if it cannot brake before red light?
                 } else {
-                    v = min2double(v, getStopBeforeSpeed(controllerInfo.drivable->getLength() - controllerInfo.dis,
+                    v = min2double(v, getStopBeforeSpeed(controllerInfo.drivable->getLength() - getDistance(),
                                                          interval));
                     return v;
                 }
@@ -357,8 +377,8 @@ namespace CityFlow {
         if (laneLink == nullptr && controllerInfo.drivable->isLaneLink())
             laneLink = static_cast<const LaneLink*>(controllerInfo.drivable);
         double distanceToLaneLinkStart = controllerInfo.drivable->isLane()
-                                         ? -(controllerInfo.drivable->getLength() - controllerInfo.dis)
-                                         : controllerInfo.dis;
+                                         ? -(controllerInfo.drivable->getLength() - getDistance())
+                                         : getDistance();
         double distanceOnLaneLink;
         for (auto &cross : laneLink->getCrosses()) {
             distanceOnLaneLink = cross->getDistanceByLane(laneLink);
@@ -400,15 +420,6 @@ namespace CityFlow {
             laneChange->signalRecv = sender->laneChange->signalSend;
     }
 
-    std::list<Vehicle *>::iterator Vehicle::getListIterator() {
-        assert(getCurDrivable()->isLane());
-        Segment *seg = ((Lane *)getCurDrivable())->getSegment(getSegmentIndex());
-
-
-        auto result = seg->findVehicle(this);
-        return result;
-    }
-
     void Vehicle::abortLaneChange() {
         assert(laneChangeInfo.partner);
         this->setEnd(true);
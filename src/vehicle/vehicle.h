@@ -2,9 +2,11 @@
 #define CITYFLOW_VEHICLE
 
 #include "utility/utility.h"
+#include "utility/pool.h"
 #include "flow/route.h"
 #include "vehicle/router.h"
 #include "vehicle/lanechange.h"
+#include "vehicle/vehiclestate.h"
 
 #include <utility>
 #include <memory>
@@ -50,6 +52,7 @@ namespace CityFlow {
         friend class LaneChange;
         friend class SimpleLaneChange;
         friend class Archive;
+        friend class VehicleStateStore;
     private:
         struct Buffer {
             bool isDisSet = false;
@@ -83,7 +86,7 @@ namespace CityFlow {
             Drivable *drivable = nullptr;
             Drivable *prevDrivable = nullptr;
             double approachingIntersectionDistance;
-            double gap;
+            double gap = 0; // kept while there is no leader, read by lane changes
             size_t enterLaneLinkTime;
             Vehicle *leader = nullptr;
             Vehicle *blocker = nullptr;
@@ -100,6 +103,12 @@ namespace CityFlow {
 
         Buffer buffer;
 
+        // Once on a drivable, the speed, distance, gap, leader and custom speed above are only
+        // the values the vehicle was attached with, the current ones are in the slot. Vehicles
+        // waiting to enter, and copies outside an engine like those of an Archive, keep their own.
+        VehicleStateStore *state = nullptr;
+        size_t slot = 0;
+
         int priority;
         std::string id;
         double enterTime;
@@ -111,6 +120,14 @@ namespace CityFlow {
         bool routeValid = false;
         Flow *flow;
 
+        // takes the current values of an attached vehicle into this copy
+        void copyState(const Vehicle &vehicle);
+
+        void setLeader(Vehicle *leader);
+
+        // closest vehicle on the drivables ahead, the gap is only written when there is one
+        Vehicle *findLeaderAhead(double &gap);
+
     public:
 
         bool isStraightHold = false;
@@ -121,13 +138,24 @@ namespace CityFlow {
 
         Vehicle(const VehicleInfo &init, const std::string &id, Engine *engine, Flow *flow = nullptr);
 
+        ~Vehicle();
+
+        static void *operator new(std::size_t size) { return SmallObjectPool::allocate(size); }
+
+        static void operator delete(void *pointer, std::size_t size) { SmallObjectPool::deallocate(pointer, size); }
+
         void setDeltaDistance(double dis);
 
         void setSpeed(double speed);
 
         void setCustomSpeed(double speed) {
-            buffer.customSpeed = speed;
-            buffer.isCustomSpeedSet = true;
+            if (!state) {
+                buffer.customSpeed = speed;
+                buffer.isCustomSpeedSet = true;
+                return;
+            }
+            state->customSpeed[slot] = speed;
+            state->hasCustomSpeed[slot] = 1;
         }
 
         void setDis(double dis) {
@@ -144,7 +172,7 @@ namespace CityFlow {
 
         bool hasSetSpeed() const { return buffer.isSpeedSet; }
 
-        bool hasSetCustomSpeed() const { return buffer.isCustomSpeedSet; }
+        bool hasSetCustomSpeed() const { return state ? state->hasCustomSpeed[slot] != 0 : buffer.isCustomSpeedSet; }
 
         double getBufferSpeed() const { return buffer.speed; };
 
@@ -171,19 +199,25 @@ namespace CityFlow {
 
         double getBufferDis() const { return buffer.dis; }
 
+        // distance once the step is applied, the current one if the step has not moved it
+        double getNextDistance() const { return buffer.isDisSet ? buffer.dis : getDistance(); }
+
         void update();
 
+        // takes a slot of the store, done by the engine when the vehicle enters its first drivable
+        void attach(VehicleStateStore &store);
+
         void setPriority(int priority) { this->priority = priority; }
 
-        inline std::string getId() const { return id; }
+        inline const std::string &getId() const { return id; }
 
-        inline double getSpeed() const { return vehicleInfo.speed; }
+        inline double getSpeed() const { return state ? state->speed[slot] : vehicleInfo.speed; }
 
         inline double getLen() const { return vehicleInfo.len; }
 
         inline double getWidth() const { return vehicleInfo.width; }
 
-        inline double getDistance() const { return controllerInfo.dis; }
+        inline double getDistance() const { return state ? state->dis[slot] : controllerInfo.dis; }
 
         Point getPoint() const;
 
@@ -236,12 +270,12 @@ namespace CityFlow {
 
         double getBrakeDistanceAfterAccel(double acc, double dec, double interval) const;
 
-        inline double getMinBrakeDistance() const { return 0.5 * vehicleInfo.speed * vehicleInfo.speed / vehicleInfo.maxNegAcc; }
+        inline double getMinBrakeDistance() const { return 0.5 * getSpeed() * getSpeed() / vehicleInfo.maxNegAcc; }
 
-        inline double getUsualBrakeDistance() const { return 0.5 * vehicleInfo.speed * vehicleInfo.speed / vehicleInfo.usualNegAcc; }
+        inline double getUsualBrakeDistance() const { return 0.5 * getSpeed() * getSpeed() / vehicleInfo.usualNegAcc; }
 
-        double getNoCollisionSpeed(double vL, double dL, double vF, double dF, double gap, double interval,
-            double targetGap) const;
+        static double getNoCollisionSpeed(double vL, double dL, double vF, double dF, double gap, double interval,
+            double targetGap);
 
         double getCarFollowSpeed(double interval);
 
@@ -257,7 +291,11 @@ namespace CityFlow {
 
         void updateLeaderAndGap(Vehicle *leader);
 
-        Vehicle *getLeader() const { return controllerInfo.leader; }
+        Vehicle *getLeader() const {
+            if (!state) return controllerInfo.leader;
+            size_t leader = state->leader[slot];
+            return leader == VehicleStateStore::NO_LEADER ? nullptr : state->vehicles[leader];
+        }
 
         inline double getEnterLaneLinkTime() const { return controllerInfo.enterLaneLinkTime; }
 
@@ -316,7 +354,6 @@ namespace CityFlow {
 
         std::shared_ptr<LaneChange> getLaneChange(){ return laneChange; }
 
-        std::list<Vehicle *>::iterator getListIterator();
 
         void insertShadow(Vehicle *shadow) { laneChange->insertShadow(shadow); }
 
@@ -329,7 +366,7 @@ namespace CityFlow {
 
         bool canChange() const{ return laneChange->canChange(); }
 
-        double getGap() const{ return controllerInfo.gap; }
+        double getGap() const{ return state ? state->gap[slot] : controllerInfo.gap; }
 
         int laneChangeUrgency() const { return laneChange->signalSend->urgency; }
 
@@ -0,0 +1,125 @@
+#include "vehicle/vehiclestate.h"
+#include "vehicle/vehicle.h"
+#include "roadnet/roadnet.h"
+
+#include <algorithm>
+
+namespace CityFlow {
+
+    const size_t VehicleStateStore::NO_LEADER = static_cast<size_t>(-1);
+
+    // column[i] becomes column[order[i]], the slots after the order keep their room
+    template <typename T>
+    static void permute(std::vector<T> &column, const std::vector<size_t> &order) {
+        std::vector<T> sorted(column.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            sorted[i] = column[order[i]];
+        column.swap(sorted);
+    }
+
+    void VehicleStateStore::reserve(size_t vehicleCount) {
+        size_t available = freeSlots.size() + vehicles.size() - count;
+        if (available >= vehicleCount) return;
+        size_t capacity = std::max(vehicles.size() + vehicleCount - available, vehicles.size() * 2);
+        vehicles.resize(capacity, nullptr);
+        speed.resize(capacity);
+        dis.resize(capacity);
+        gap.resize(capacity);
+        customSpeed.resize(capacity);
+        hasCustomSpeed.resize(capacity);
+        leader.resize(capacity, NO_LEADER);
+        maxSpeed.resize(capacity);
+        maxNegAcc.resize(capacity);
+        usualNegAcc.resize(capacity);
+        minGap.resize(capacity);
+        headwayTime.resize(capacity);
+        followSpeed.resize(capacity);
+    }
+
+    void VehicleStateStore::clear() {
+        std::fill(vehicles.begin(), vehicles.end(), nullptr);
+        freeSlots.clear();
+        count = 0;
+    }
+
+    size_t VehicleStateStore::allocate(Vehicle *vehicle) {
+        std::lock_guard<std::mutex> guard(mutex);
+        size_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            if (count == vehicles.size()) reserve(std::max(count, (size_t) BLOCK_SIZE));
+            slot = count++;
+        }
+        vehicles[slot] = vehicle;
+        return slot;
+    }
+
+    void VehicleStateStore::release(size_t slot) {
+        std::lock_guard<std::mutex> guard(mutex);
+        vehicles[slot] = nullptr;
+        leader[slot] = NO_LEADER;
+        freeSlots.push_back(slot);
+    }
+
+    void VehicleStateStore::computeCarFollowSpeed(size_t begin, size_t end, double interval, SimdLevel level) {
+        // the leader fields are looked up a block at a time, the block stays in the first level cache
+        double leaderSpeed[BLOCK_SIZE], leaderMaxNegAcc[BLOCK_SIZE], leaderUsualNegAcc[BLOCK_SIZE];
+        double hasLeader[BLOCK_SIZE];
+        for (size_t first = begin; first < end; first += BLOCK_SIZE) {
+            size_t size = std::min(end - first, (size_t) BLOCK_SIZE);
+            for (size_t i = 0; i < size; ++i) {
+                size_t slot = leader[first + i];
+                bool found = slot != NO_LEADER;
+                hasLeader[i] = found ? 1 : 0;
+                leaderSpeed[i] = found ? speed[slot] : 0;
+                leaderMaxNegAcc[i] = found ? maxNegAcc[slot] : 1;
+                leaderUsualNegAcc[i] = found ? usualNegAcc[slot] : 1;
+            }
+            CarFollowBatch batch = {size, &speed[first], &gap[first], &maxSpeed[first], &maxNegAcc[first],
+                                    &usualNegAcc[first], &minGap[first], &headwayTime[first], &customSpeed[first],
+                                    leaderSpeed, leaderMaxNegAcc, leaderUsualNegAcc,
+                                    hasLeader, &hasCustomSpeed[first], &followSpeed[first]};
+            CityFlow::computeCarFollowSpeed(batch, interval, level);
+        }
+    }
+
+    void VehicleStateStore::sortByDrivable(const std::vector<std::vector<Drivable *>> &drivablePools) {
+        std::vector<size_t> order, newSlot(count, NO_LEADER);
+        order.reserve(count - freeSlots.size());
+        auto place = [&order, &newSlot](size_t slot) {
+            if (newSlot[slot] != NO_LEADER) return;
+            newSlot[slot] = order.size();
+            order.push_back(slot);
+        };
+        for (const auto &pool : drivablePools)
+            for (const Drivable *drivable : pool)
+                for (const Vehicle *vehicle : drivable->getVehicles())
+                    place(vehicle->slot);
+        for (size_t slot = 0; slot < count; ++slot)
+            if (vehicles[slot]) place(slot);
+
+        permute(vehicles, order);
+        permute(speed, order);
+        permute(dis, order);
+        permute(gap, order);
+        permute(customSpeed, order);
+        permute(hasCustomSpeed, order);
+        permute(leader, order);
+        permute(maxSpeed, order);
+        permute(maxNegAcc, order);
+        permute(usualNegAcc, order);
+        permute(minGap, order);
+        permute(headwayTime, order);
+        count = order.size();
+        freeSlots.clear();
+        for (size_t slot = count; slot < leader.size(); ++slot)
+            leader[slot] = NO_LEADER;
+        for (size_t slot = 0; slot < count; ++slot) {
+            vehicles[slot]->slot = slot;
+            // a leader released since it was found has no new slot, it is looked up again before use
+            if (leader[slot] != NO_LEADER) leader[slot] = newSlot[leader[slot]];
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef CITYFLOW_VEHICLESTATE_H
+#define CITYFLOW_VEHICLESTATE_H
+
+#include "vehicle/carfollow.h"
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace CityFlow {
+    class Drivable;
+    class Vehicle;
+
+    // The hot fields of the vehicles of an engine, one column per field. Every vehicle on a
+    // drivable owns a slot and reads its speed, distance, gap and leader from here, so the
+    // car-following kernel runs over the columns in place. Slots are sorted by drivable from
+    // time to time, which keeps followers next to their leaders.
+    class VehicleStateStore {
+        friend class Vehicle;
+    public:
+        static const size_t NO_LEADER;
+
+        // Makes room for vehicleCount more vehicles. Vehicles attached by several threads at
+        // once, the shadows of lane changes, must fit in it, the columns never move then.
+        void reserve(size_t vehicleCount);
+
+        // drops every slot, once no vehicle is attached any more
+        void clear();
+
+        // slots in use or released, the range the kernel runs over
+        size_t size() const { return count; }
+
+        // car following of the slots in [begin, end), read by Vehicle::getCarFollowSpeed
+        void computeCarFollowSpeed(size_t begin, size_t end, double interval, SimdLevel level);
+
+        // Gives the vehicles slots in the order of the drivables of each pool, from the front
+        // of each drivable, and the other vehicles the slots after them. Leaders follow.
+        void sortByDrivable(const std::vector<std::vector<Drivable *>> &drivablePools);
+
+    private:
+        static const size_t BLOCK_SIZE = 256;
+
+        size_t allocate(Vehicle *vehicle);
+
+        void release(size_t slot);
+
+        std::mutex mutex;
+        std::vector<size_t> freeSlots;
+        size_t count = 0;
+
+        std::vector<Vehicle *> vehicles; // owner of each slot, null once released
+        std::vector<double> speed, dis, gap, customSpeed, hasCustomSpeed;
+        std::vector<size_t> leader;
+        std::vector<double> maxSpeed, maxNegAcc, usualNegAcc, minGap, headwayTime;
+        std::vector<double> followSpeed;
+    };
+}
+
+#endif //CITYFLOW_VEHICLESTATE_H
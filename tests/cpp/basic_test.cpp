@@ -1,12 +1,17 @@
 #include "engine/engine.h"
+#include "engine/vectorengine.h"
 #include <string>
 #include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <list>
 #include <gtest/gtest.h>
 
 using namespace CityFlow;
 
 size_t threads = std::min(std::thread::hardware_concurrency(), 4u);
 std::string configFile = "examples/config.json";
+std::string laneChangeConfigFile = "examples/config_lanechange.json";
 
 TEST(Basic, Basic) {
     size_t totalStep = 2000;
@@ -30,6 +35,7 @@ TEST(Basic, API) {
         engine.getVehicleDistance();
         engine.getCurrentTime();
         engine.getVehicleCount();
+        EXPECT_GE(engine.getImbalanceFactor(), 1.0);
     }
     SUCCEED();
 }
@@ -52,7 +58,357 @@ TEST(Basic, reset) {
     SUCCEED();
 }
 
+TEST(Basic, threadCount) {
+    size_t totalStep = 500;
+
+    Engine single(configFile, 1);
+    Engine multi(configFile, 4);
+    for (size_t i = 0; i < totalStep; i++) {
+        single.nextStep();
+        multi.nextStep();
+    }
+    EXPECT_EQ(single.getVehicleCount(), multi.getVehicleCount());
+    EXPECT_EQ(single.getVehicleDistance(), multi.getVehicleDistance());
+    EXPECT_EQ(single.getAverageTravelTime(), multi.getAverageTravelTime());
+}
+
+TEST(Basic, laneChangeThreadCount) {
+    size_t totalStep = 1000;
+
+    Engine single(laneChangeConfigFile, 1);
+    Engine multi(laneChangeConfigFile, 4);
+    for (size_t i = 0; i < totalStep; i++) {
+        single.nextStep();
+        multi.nextStep();
+        ASSERT_EQ(single.getVehicleDistance(), multi.getVehicleDistance()) << "step " << i;
+    }
+    EXPECT_EQ(single.getVehicleSpeed(), multi.getVehicleSpeed());
+    EXPECT_EQ(single.getAverageTravelTime(), multi.getAverageTravelTime());
+}
+
+TEST(Basic, travelTime) {
+    size_t totalStep = 1000;
+
+    // retired vehicles are summed in the same order whatever thread took them
+    Engine single(laneChangeConfigFile, 1);
+    for (size_t i = 0; i < totalStep; i++)
+        single.nextStep();
+    for (int threadNum : {2, 3, 8}) {
+        Engine multi(laneChangeConfigFile, threadNum);
+        for (size_t i = 0; i < totalStep; i++)
+            multi.nextStep();
+        EXPECT_EQ(single.getAverageTravelTime(), multi.getAverageTravelTime()) << threadNum << " threads";
+    }
+}
+
+TEST(Basic, allocation) {
+    size_t totalStep = 500;
+
+    Engine engine(configFile, threads);
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+    }
+    size_t chunks = engine.getAllocationStats()["chunk_allocations"];
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+    }
+    EXPECT_EQ(engine.getAllocationStats()["chunk_allocations"], chunks);
+}
+
+TEST(Basic, scalarCarFollow) {
+    size_t totalStep = 500;
+
+    Engine vectorized(configFile, threads);
+    Engine scalar(configFile, threads);
+    scalar.setScalarCarFollow(true);
+    for (size_t i = 0; i < totalStep; i++) {
+        vectorized.nextStep();
+        scalar.nextStep();
+    }
+    std::map<std::string, double> speeds = scalar.getVehicleSpeed();
+    for (const auto &speed : vectorized.getVehicleSpeed()) {
+        ASSERT_EQ(speeds.count(speed.first), 1u);
+        EXPECT_NEAR(speeds[speed.first], speed.second, CAR_FOLLOW_TOLERANCE);
+    }
+    EXPECT_EQ(vectorized.getVehicleCount(), scalar.getVehicleCount());
+    EXPECT_EQ(vectorized.getKernelVariant(), getSimdLevelName(getSimdLevel()));
+    EXPECT_EQ(scalar.getKernelVariant(), "generic");
+}
+
+TEST(Basic, laneMetrics) {
+    size_t totalStep = 300;
+
+    Engine engine(configFile, threads);
+    std::vector<std::string> laneIds = engine.getLaneIds();
+    std::shared_ptr<const LaneMetrics> metrics;
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+        metrics = engine.getLaneMetrics();
+        std::map<std::string, int> counts = engine.getLaneVehicleCount();
+        std::map<std::string, int> waiting = engine.getLaneWaitingVehicleCount();
+        ASSERT_EQ(metrics->vehicleCount.size(), laneIds.size());
+        for (size_t j = 0; j < laneIds.size(); j++) {
+            EXPECT_EQ(metrics->vehicleCount[j], counts[laneIds[j]]);
+            EXPECT_EQ(metrics->waitingVehicleCount[j], waiting[laneIds[j]]);
+            EXPECT_GE(metrics->occupancy[j], 0);
+        }
+    }
+    // metrics still held are not overwritten by later steps
+    std::vector<double> speeds = metrics->meanSpeed;
+    engine.nextStep();
+    EXPECT_EQ(metrics->meanSpeed, speeds);
+    EXPECT_NE(engine.getLaneMetrics(), metrics);
+    engine.reset();
+    for (int count : engine.getLaneMetrics()->vehicleCount)
+        EXPECT_EQ(count, 0);
+}
+
+TEST(Basic, vehicleState) {
+    size_t totalStep = 300;
+
+    Engine engine(configFile, threads);
+    std::shared_ptr<const VehicleStateColumns> state;
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+        state = engine.getVehicleState();
+        std::map<std::string, double> speeds = engine.getVehicleSpeed();
+        std::map<std::string, double> distances = engine.getVehicleDistance();
+        ASSERT_EQ(state->size(), speeds.size());
+        for (size_t j = 0; j < state->size(); j++) {
+            std::string id = engine.getVehicleId(state->handle[j]);
+            EXPECT_EQ(state->speed[j], speeds[id]);
+            EXPECT_EQ(state->distance[j], distances[id]);
+        }
+    }
+    // columns still held are not overwritten by later steps
+    std::vector<double> speeds = state->speed;
+    engine.nextStep();
+    EXPECT_EQ(state->speed, speeds);
+    EXPECT_NE(engine.getVehicleState(), state);
+}
+
+TEST(Basic, vehicleHandle) {
+    size_t totalStep = 600;
+
+    Engine engine(laneChangeConfigFile, threads);
+    std::map<std::string, VehicleRegistry::Handle> handles;
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+        std::shared_ptr<const VehicleStateColumns> state = engine.getVehicleState();
+        for (size_t j = 0; j < state->size(); j++) {
+            std::string id = engine.getVehicleId(state->handle[j]);
+            // a vehicle keeps its handle through lane changes
+            auto iter = handles.find(id);
+            if (iter != handles.end())
+                EXPECT_EQ(iter->second, state->handle[j]) << id;
+            handles[id] = state->handle[j];
+        }
+    }
+    std::shared_ptr<const VehicleStateColumns> last = engine.getVehicleState();
+    ASSERT_GT(last->size(), 0u);
+    engine.reset();
+    for (size_t i = 0; i < 100; i++)
+        engine.nextStep();
+    // the slots are taken by other vehicles, the old handles do not reach them
+    ASSERT_GT(engine.getVehicleCount(), 0u);
+    for (VehicleRegistry::Handle handle : last->handle)
+        EXPECT_THROW(engine.getVehicleId(handle), std::runtime_error);
+}
+
+TEST(Basic, subscription) {
+    size_t totalStep = 300;
+
+    Engine engine(configFile, threads);
+    Engine serial(configFile, threads);
+    engine.subscribe("road");
+    engine.subscribe("intersection", {"waiting_vehicle_count"});
+    EXPECT_THROW(engine.subscribe("road", {"color"}), std::invalid_argument);
+    EXPECT_THROW(engine.subscribe("sky"), std::invalid_argument);
+    for (size_t i = 0; i < totalStep; i++) {
+        engine.nextStep();
+        serial.nextStep();
+        // metrics taken by the workers match the ones taken on demand
+        std::shared_ptr<const RoadMetrics> roads = engine.getRoadMetrics();
+        std::shared_ptr<const RoadMetrics> serialRoads = serial.getRoadMetrics();
+        EXPECT_EQ(roads->vehicleCount, serialRoads->vehicleCount);
+        EXPECT_EQ(roads->waitingVehicleCount, serialRoads->waitingVehicleCount);
+        EXPECT_EQ(roads->meanSpeed, serialRoads->meanSpeed);
+        EXPECT_EQ(engine.getIntersectionMetrics()->waitingVehicleCount,
+                  serial.getIntersectionMetrics()->waitingVehicleCount);
+        serial.unsubscribe("road");
+        serial.unsubscribe("intersection");
+    }
+    EXPECT_EQ(engine.getSubscriptions().getVariables(ObservationDomain::INTERSECTION).size(), 1u);
+}
+
+TEST(Basic, nextSteps) {
+    Engine stepped(configFile, threads);
+    Engine batched(configFile, threads);
+    for (size_t i = 0; i < 100; i++)
+        stepped.nextStep();
+    EXPECT_EQ(batched.nextSteps(50), 50u);
+    EXPECT_EQ(batched.runUntil(100 * batched.getInterval()), 50u);
+    EXPECT_EQ(batched.runUntil(0), 0u);
+    EXPECT_DOUBLE_EQ(batched.getCurrentTime(), stepped.getCurrentTime());
+    EXPECT_EQ(batched.getVehicleCount(), stepped.getVehicleCount());
+    EXPECT_FALSE(batched.isEmpty());
+}
+
+TEST(Basic, asyncStep) {
+    Engine stepped(configFile, threads);
+    Engine async(configFile, threads);
+    EXPECT_TRUE(async.pollStep());
+    for (size_t i = 0; i < 100; i++) {
+        stepped.nextStep();
+        async.nextStepAsync();
+        async.waitStep();
+        EXPECT_TRUE(async.pollStep());
+    }
+    async.nextStepAsync();
+    async.nextStepAsync();
+    async.waitStep();
+    stepped.nextSteps(2);
+    EXPECT_DOUBLE_EQ(async.getCurrentTime(), stepped.getCurrentTime());
+    EXPECT_EQ(async.getVehicleSpeed(), stepped.getVehicleSpeed());
+}
+
+TEST(Basic, vectorEngine) {
+    VectorEngine vector(configFile, 3, threads, 50);
+    Engine single(configFile, 1);
+    vector.subscribe("lane", {"vehicle_count"});
+    for (size_t i = 0; i < 49; i++) {
+        vector.nextStep();
+        single.nextStep();
+    }
+    size_t laneNum = vector.getLaneIds().size();
+    std::shared_ptr<const LaneMetrics> metrics = vector.getLaneMetrics();
+    const std::vector<int> &counts = metrics->vehicleCount;
+    ASSERT_EQ(counts.size(), 3 * laneNum);
+    EXPECT_EQ(std::vector<int>(counts.begin(), counts.begin() + laneNum), single.getLaneMetrics()->vehicleCount);
+    EXPECT_EQ(vector.getEnv(0).getVehicleCount(), single.getVehicleCount());
+    for (unsigned char done : vector.getDones())
+        EXPECT_FALSE(done);
+
+    // metrics still held are not overwritten by later steps
+    std::vector<int> kept = counts;
+    vector.nextStep();
+    EXPECT_EQ(metrics->vehicleCount, kept);
+    EXPECT_NE(vector.getLaneMetrics(), metrics);
+    for (size_t i = 0; i < vector.getEnvNum(); i++) {
+        EXPECT_TRUE(vector.getDones()[i]);
+        EXPECT_DOUBLE_EQ(vector.getEnv(i).getCurrentTime(), 0);
+    }
+
+    // a reset takes the metrics of the new episode
+    for (size_t i = 0; i < 10; i++)
+        vector.nextStep();
+    vector.reset();
+    single.reset(true);
+    std::vector<int> initial = single.getLaneMetrics()->vehicleCount;
+    const std::vector<int> &resetCounts = vector.getLaneMetrics()->vehicleCount;
+    for (size_t i = 0; i < vector.getEnvNum(); i++)
+        EXPECT_EQ(std::vector<int>(resetCounts.begin() + i * laneNum, resetCounts.begin() + (i + 1) * laneNum), initial);
+}
+
+TEST(Basic, sharedRoadNet) {
+    Engine first(configFile, 1);
+    Engine second(configFile, threads);
+    const RoadNet &roadnet = first.getRoadNet();
+    ASSERT_TRUE(roadnet.getSource() != nullptr);
+    EXPECT_EQ(roadnet.getSource(), second.getRoadNet().getSource());
+    EXPECT_EQ(roadnet.getSource()->drivableGeometry.size(), roadnet.getDrivables().size());
+    for (size_t i = 0; i < 100; i++) {
+        first.nextStep();
+        second.nextStep();
+    }
+    EXPECT_EQ(first.getVehicleSpeed(), second.getVehicleSpeed());
+}
+
+// history window of a lane kept in a list, the way the lanes used to
+struct LaneHistoryReference {
+    static const size_t historyLen = 240; // as Lane::historyLen
+
+    std::list<std::pair<int, double>> records;
+    int vehicleNum = 0;
+    double averageSpeed = 0;
+    bool busy = false;
+
+    void update(const Lane &lane) {
+        double speedSum = vehicleNum * averageSpeed;
+        while (records.size() > historyLen) {
+            vehicleNum -= records.front().first;
+            speedSum -= records.front().first * records.front().second;
+            records.pop_front();
+        }
+        int count = (int) lane.getVehicles().size();
+        double curSpeedSum = 0;
+        for (const Vehicle *vehicle : lane.getVehicles())
+            curSpeedSum += vehicle->getSpeed();
+        vehicleNum += count;
+        speedSum += curSpeedSum;
+        records.emplace_back(count, count ? curSpeedSum / count : 0);
+        averageSpeed = vehicleNum ? speedSum / vehicleNum : 0;
+        busy = busy || count > 0;
+    }
+
+    void expectMatches(const Lane &lane) const {
+        EXPECT_EQ(lane.getHistoryVehicleNum(), vehicleNum) << lane.getId();
+        EXPECT_DOUBLE_EQ(lane.getHistoryAverageSpeed(), averageSpeed) << lane.getId();
+        auto history = lane.getHistory();
+        ASSERT_EQ(history.size(), records.size()) << lane.getId();
+        auto record = records.begin();
+        for (size_t i = 0; i < history.size(); ++i, ++record) {
+            EXPECT_EQ(history[i].vehicleNum, record->first) << lane.getId();
+            EXPECT_DOUBLE_EQ(history[i].averageSpeed, record->second) << lane.getId();
+        }
+    }
+};
+
+TEST(Basic, laneHistory) {
+    // the lights are held so that the exit lanes of the straight movements run empty, fill
+    // up and run empty again for longer than the window
+    std::string config = testing::TempDir() + "cityflow_history_config.json";
+    std::ofstream(config) << "{\"interval\": 1.0, \"seed\": 0, \"dir\": \"examples/\", "
+                             "\"roadnetFile\": \"roadnet.json\", \"flowFile\": \"flow.json\", "
+                             "\"rlTrafficLight\": true, \"laneChange\": false, \"saveReplay\": false}";
+    Engine engine(config, threads);
+    const std::vector<Lane *> &lanes = engine.getRoadNet().getLanes();
+    std::vector<LaneHistoryReference> references(lanes.size());
+    auto run = [&](int phase, size_t steps) {
+        engine.setTrafficLightPhase("intersection_1_1", phase);
+        for (size_t i = 0; i < steps; i++) {
+            engine.nextStep();
+            for (size_t j = 0; j < lanes.size(); j++) {
+                references[j].update(*lanes[j]);
+                references[j].expectMatches(*lanes[j]);
+            }
+        }
+    };
+    run(1, 300);
+    run(0, 60);
+    run(1, 400);
+
+    size_t drained = 0;
+    for (const LaneHistoryReference &reference : references)
+        if (reference.busy && reference.vehicleNum == 0) drained++;
+    ASSERT_GT(drained, 0u);
+
+    // the archive is taken with traffic in the window and loaded while the lanes run empty
+    run(0, 60);
+    run(1, 50);
+    Archive archive = engine.snapshot();
+    std::vector<LaneHistoryReference> saved = references;
+    run(1, 300);
+    engine.load(archive);
+    references = saved;
+    for (size_t j = 0; j < lanes.size(); j++)
+        references[j].expectMatches(*lanes[j]);
+    run(1, 300);
+    run(0, 30);
+    std::remove(config.c_str());
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
@@ -1,3 +1,4 @@
+import asyncio
 import unittest
 import cityflow
 
@@ -26,6 +27,183 @@ class TestAPI(unittest.TestCase):
 
         del eng
 
+    def test_lane_metrics(self):
+        """lane metric arrays agree with the dict api"""
+        eng = cityflow.Engine(config_file=self.config_file, thread_num=4)
+        lane_ids = eng.get_lane_ids()
+
+        for _ in range(300):
+            eng.next_step()
+            metrics = eng.get_lane_metrics()
+            counts = eng.get_lane_vehicle_count()
+            waiting = eng.get_lane_waiting_vehicle_count()
+            self.assertEqual(len(metrics["vehicle_count"]), len(lane_ids))
+            for i, lane in enumerate(lane_ids):
+                self.assertEqual(metrics["vehicle_count"][i], counts[lane])
+                self.assertEqual(metrics["waiting_vehicle_count"][i], waiting[lane])
+        self.assertFalse(metrics["occupancy"].flags.writeable)
+        mean_speed = metrics["mean_speed"].copy()
+        eng.next_step_async()
+        eng.wait_step()
+        self.assertTrue((metrics["mean_speed"] == mean_speed).all())
+
+        del eng
+
+    def test_vehicle_state(self):
+        """vehicle state columns agree with the dict api"""
+        eng = cityflow.Engine(config_file=self.config_file, thread_num=4)
+
+        for _ in range(300):
+            eng.next_step()
+            state = eng.get_vehicle_state()
+            speeds = eng.get_vehicle_speed()
+            self.assertEqual(len(state["handle"]), len(speeds))
+            for handle, speed in zip(state["handle"], state["speed"]):
+                self.assertEqual(speeds[eng.get_vehicle_id(handle)], speed)
+        speed = state["speed"].copy()
+        eng.next_step()
+        self.assertTrue((state["speed"] == speed).all())
+
+        del eng
+
+    def test_subscription(self):
+        """subscribed variables are taken at the end of every step"""
+        eng = cityflow.Engine(config_file=self.config_file, thread_num=4)
+        eng.subscribe("lane", ["vehicle_count"])
+        eng.subscribe("vehicle", ["speed"])
+        eng.subscribe("intersection")
+        self.assertRaises(ValueError, eng.subscribe, "lane", ["color"])
+        lane_ids = eng.get_lane_ids()
+
+        for _ in range(300):
+            eng.next_step()
+            results = eng.get_subscription_results()
+            self.assertEqual(set(results.keys()), {"lane", "vehicle", "intersection"})
+            self.assertEqual(list(results["lane"].keys()), ["vehicle_count"])
+            counts = eng.get_lane_vehicle_count()
+            for i, lane in enumerate(lane_ids):
+                self.assertEqual(results["lane"]["vehicle_count"][i], counts[lane])
+            self.assertEqual(len(results["vehicle"]["speed"]), eng.get_vehicle_count())
+            self.assertEqual(len(results["intersection"]["phase"]), len(eng.get_intersection_ids()))
+
+        eng.unsubscribe("vehicle")
+        eng.next_step()
+        self.assertNotIn("vehicle", eng.get_subscription_results())
+
+        del eng
+
+    def test_next_steps(self):
+        """multi-step advance matches single steps"""
+        stepped = cityflow.Engine(config_file=self.config_file, thread_num=1)
+        batched = cityflow.Engine(config_file=self.config_file, thread_num=1)
+
+        for _ in range(100):
+            stepped.next_step()
+        self.assertEqual(batched.next_steps(50), 50)
+        self.assertEqual(batched.run_until(100), 50)
+        self.assertEqual(batched.get_current_time(), stepped.get_current_time())
+        self.assertEqual(batched.get_vehicle_speed(), stepped.get_vehicle_speed())
+        self.assertFalse(batched.is_empty())
+
+        del stepped, batched
+
+    def test_next_step_async(self):
+        """steps run in the background match blocking steps"""
+        stepped = cityflow.Engine(config_file=self.config_file, thread_num=1)
+        async_eng = cityflow.Engine(config_file=self.config_file, thread_num=1)
+
+        for _ in range(50):
+            stepped.next_step()
+            future = async_eng.next_step_async()
+            future.wait()
+            self.assertTrue(future.done())
+            self.assertTrue(async_eng.poll())
+
+        async def run():
+            for _ in range(50):
+                await async_eng.next_step_async()
+
+        asyncio.run(run())
+        async_eng.next_step_async()
+        stepped.next_steps(51)
+        self.assertEqual(async_eng.get_current_time(), stepped.get_current_time())
+        self.assertEqual(async_eng.get_vehicle_speed(), stepped.get_vehicle_speed())
+
+        del stepped, async_eng
+
+    def test_vector_engine(self):
+        """environments step together and reset once done"""
+        envs = cityflow.VectorEngine(config_file=self.config_file, env_num=4, thread_num=2, episode_steps=50)
+        single = cityflow.Engine(config_file=self.config_file, thread_num=1)
+        envs.subscribe("lane", ["vehicle_count"])
+        lane_num = len(envs.get_lane_ids())
+
+        for _ in range(49):
+            observations, dones = envs.next_step()
+            single.next_step()
+            self.assertFalse(dones.any())
+        counts = observations["lane"]["vehicle_count"]
+        self.assertEqual(counts.shape, (4, lane_num))
+        self.assertEqual(list(counts[0]), list(single.get_lane_metrics()["vehicle_count"]))
+
+        # kept observations are not overwritten by the next step
+        kept = counts.copy()
+        _, dones = envs.next_step()
+        self.assertTrue(dones.all())
+        self.assertEqual(envs.get_env(0).get_current_time(), 0)
+        self.assertTrue((counts == kept).all())
+
+        # reset returns the observations of the new episode
+        envs.next_step()
+        observations = envs.reset()
+        single.reset(seed=True)
+        initial = list(single.get_lane_metrics()["vehicle_count"])
+        self.assertEqual(observations["lane"]["vehicle_count"].shape, (4, lane_num))
+        for row in observations["lane"]["vehicle_count"]:
+            self.assertEqual(list(row), initial)
+
+        del envs, single
+
+    def test_imbalance_factor(self):
+        """threads are rebalanced while the simulation runs"""
+        eng = cityflow.Engine(config_file=self.config_file, thread_num=4)
+
+        for _ in range(1000):
+            eng.next_step()
+            self.assertGreaterEqual(eng.get_imbalance_factor(), 1.0)
+
+        del eng
+
+    def test_allocation_stats(self):
+        """vehicles are recycled once the simulation is warmed up"""
+        eng = cityflow.Engine(config_file=self.config_file, thread_num=4)
+
+        for _ in range(500):
+            eng.next_step()
+        chunks = eng.get_allocation_stats()["chunk_allocations"]
+        for _ in range(500):
+            eng.next_step()
+        self.assertEqual(eng.get_allocation_stats()["chunk_allocations"], chunks)
+
+        del eng
+
+    def test_scalar_car_follow(self):
+        """the vector car-following kernels agree with the scalar one"""
+        vectorized = cityflow.Engine(config_file=self.config_file, thread_num=4)
+        scalar = cityflow.Engine(config_file=self.config_file, thread_num=4)
+        scalar.set_scalar_car_follow(True)
+
+        for _ in range(500):
+            vectorized.next_step()
+            scalar.next_step()
+        speeds = scalar.get_vehicle_speed()
+        for vehicle, speed in vectorized.get_vehicle_speed().items():
+            self.assertAlmostEqual(speeds[vehicle], speed, delta=1e-9)
+        self.assertIn(vectorized.get_kernel_variant(), ["generic", "sse4.2", "avx2", "avx512"])
+        self.assertEqual(scalar.get_kernel_variant(), "generic")
+
+        del vectorized, scalar
+
     def test_set_replay(self):
         """change replay path on the fly"""
         eng = cityflow.Engine(config_file=self.config_file, thread_num=1)